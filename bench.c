@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+/* Benchmarks for osh.
+ *
+ * Build and run from the repo root:
+ *   cc -O2 -pthread -o osh osh.c && cc -O2 -o bench bench.c && ./bench [launch|throughput|glob]
+ *
+ * launch: every workload is run once end-to-end through osh (a generated
+ * script fed on stdin, so it takes the real main/exec_cmd path) and once per
+ * raw spawn strategy (fork, vfork, posix_spawn) as a lower bound. osh runs
+ * with --no-rewrite so its pipelines have as many stages as the others.
+ *
+ * throughput: osh runs "bench gen | cat | ... | bench count" pipelines for
+ * several pipe sizes (OSH_PIPE_SIZE) and stage counts and we report GB/s and
+ * host CPU time per byte (from /proc/stat, so run it on an idle machine).
+ *
+ * glob: fills a directory with a million files (kept for reuse) and times
+ * osh expanding patterns in it natively against the old "sh -c" detour.
+ *
+ * Results are written as CSV to bench_output.txt. */
+
+#define READ_END 0
+#define WRITE_END 1
+#define MAX_STAGES 16
+#define MAX_LINE 80   /* osh's input line limit */
+#define GEN_BLOCK (64 * 1024)
+
+extern char **environ;
+
+static const char *osh_path = "./osh";
+static const char *self_path;
+static FILE *csv;
+
+static uint64_t now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void report (const char *suite, const char *strategy, int param, long ops, uint64_t ns) {
+    double sec = ns / 1e9;
+    double per_op_us = ops ? ns / 1e3 / ops : 0;
+    double ops_per_sec = sec > 0 ? ops / sec : 0;
+    fprintf(csv, "%s,%s,%d,%ld,%.6f,%.2f,%.1f\n", suite, strategy, param, ops, sec, per_op_us, ops_per_sec);
+    printf("%-10s %-12s %4d %8ld ops %10.2f us/op %10.1f ops/s\n", suite, strategy, param, ops, per_op_us, ops_per_sec);
+    fflush(stdout);
+}
+
+// --- SPAWN STRATEGIES ---
+/* Each strategy starts argv with the given stdin/stdout and returns the pid.
+ * Pipes are created O_CLOEXEC, so only the dup2'd ends survive the exec. */
+typedef pid_t (*spawn_fn)(char *const argv[], int in, int out);
+
+static void child_setup (int in, int out) {
+    if (in != STDIN_FILENO && dup2(in, STDIN_FILENO) < 0) _exit(127);
+    if (out != STDOUT_FILENO && dup2(out, STDOUT_FILENO) < 0) _exit(127);
+}
+
+static pid_t spawn_fork (char *const argv[], int in, int out) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_setup(in, out);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t spawn_vfork (char *const argv[], int in, int out) {
+    pid_t pid = vfork();
+    if (pid == 0) {
+        child_setup(in, out);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t spawn_posix (char *const argv[], int in, int out) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    if (in != STDIN_FILENO) posix_spawn_file_actions_adddup2(&fa, in, STDIN_FILENO);
+    if (out != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&fa, out, STDOUT_FILENO);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (rc != 0) { errno = rc; return -1; }
+    return pid;
+}
+
+typedef struct { const char *name; spawn_fn fn; } Strategy;
+
+static const Strategy strategies[] = {
+    { "fork",        spawn_fork },
+    { "vfork",       spawn_vfork },
+    { "posix_spawn", spawn_posix },
+};
+#define N_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+// run an n-stage "cat" pipeline reading /dev/null, waiting for every stage
+static int run_pipeline (spawn_fn spawn, int stages, int devnull) {
+    char *cat_argv[] = { "cat", NULL };
+    pid_t pids[MAX_STAGES];
+    int in = devnull;
+    for (int i = 0; i < stages; i++) {
+        int fd[2] = { -1, devnull };
+        if (i < stages - 1 && pipe2(fd, O_CLOEXEC) == -1) { perror("pipe2"); return -1; }
+        pids[i] = spawn(cat_argv, in, fd[WRITE_END]);
+        if (pids[i] < 0) { perror("spawn"); return -1; }
+        if (in != devnull) close(in);
+        if (fd[WRITE_END] != devnull) close(fd[WRITE_END]);
+        in = fd[READ_END];
+    }
+    for (int i = 0; i < stages; i++) waitpid(pids[i], NULL, 0);
+    return 0;
+}
+
+// --- OSH DRIVER ---
+// feed script to osh on stdin (from a memfd) and time it until osh exits
+static uint64_t run_osh (const char *script) {
+    int fd = memfd_create("osh-bench", MFD_CLOEXEC);
+    if (fd < 0) { perror("memfd_create"); exit(1); }
+    size_t len = strlen(script);
+    for (size_t off = 0; off < len; ) {
+        ssize_t w = write(fd, script + off, len - off);
+        if (w < 0) { perror("write(script)"); exit(1); }
+        off += (size_t)w;
+    }
+    lseek(fd, 0, SEEK_SET);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    // the cat stages are the workload: keep osh's peephole pass from removing them
+    char *argv[] = { (char *)osh_path, "--no-rewrite", NULL };
+
+    uint64_t t0 = now_ns();
+    pid_t pid = spawn_fork(argv, fd, devnull);
+    if (pid < 0) { perror("spawn(osh)"); exit(1); }
+    int status;
+    waitpid(pid, &status, 0);
+    uint64_t ns = now_ns() - t0;
+
+    close(fd);
+    close(devnull);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s exited abnormally\n", osh_path);
+        exit(1);
+    }
+    return ns;
+}
+
+// script with `line` repeated n times
+static char *repeat_line (const char *line, long n) {
+    size_t len = strlen(line);
+    char *s = (char *)malloc(len * (size_t)n + sizeof("exit\n"));
+    if (!s) { perror("malloc(script)"); exit(1); }
+    for (long i = 0; i < n; i++) memcpy(s + len * (size_t)i, line, len);
+    strcpy(s + len * (size_t)n, "exit\n");
+    return s;
+}
+
+// --- SUITES ---
+static void bench_true_loop (long n) {
+    char *argv[] = { "true", NULL };
+    char *script = repeat_line("true\n", n);
+    report("true", "osh", 1, n, run_osh(script));
+    free(script);
+
+    for (size_t s = 0; s < N_STRATEGIES; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < n; i++) {
+            pid_t pid = strategies[s].fn(argv, STDIN_FILENO, STDOUT_FILENO);
+            if (pid < 0) { perror("spawn"); exit(1); }
+            waitpid(pid, NULL, 0);
+        }
+        report("true", strategies[s].name, 1, n, now_ns() - t0);
+    }
+}
+
+static void bench_cat_pipeline (long n, int stages) {
+    // osh's line limit is 80 bytes: "cat < /dev/null" + " | cat" per extra stage
+    char line[128] = "cat < /dev/null";
+    for (int i = 1; i < stages; i++) strcat(line, " | cat");
+    strcat(line, "\n");
+    char *script = repeat_line(line, n);
+    report("pipeline", "osh", stages, n, run_osh(script));
+    free(script);
+
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    for (size_t s = 0; s < N_STRATEGIES; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < n; i++) {
+            if (run_pipeline(strategies[s].fn, stages, devnull) < 0) exit(1);
+        }
+        report("pipeline", strategies[s].name, stages, n, now_ns() - t0);
+    }
+    close(devnull);
+}
+
+// launch n background jobs; the clock stops once every job has been started
+static void bench_background (long n) {
+    char *argv[] = { "true", NULL };
+    char *script = repeat_line("true &\n", n);
+    report("background", "osh", 1, n, run_osh(script));
+    free(script);
+
+    for (size_t s = 0; s < N_STRATEGIES; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < n; i++) {
+            if (strategies[s].fn(argv, STDIN_FILENO, STDOUT_FILENO) < 0) { perror("spawn"); exit(1); }
+            while (waitpid(-1, NULL, WNOHANG) > 0) { /* reap finished jobs like osh does */ }
+        }
+        uint64_t ns = now_ns() - t0;
+        while (waitpid(-1, NULL, 0) > 0) { }
+        report("background", strategies[s].name, 1, n, ns);
+    }
+}
+
+// --- THROUGHPUT ---
+// generator stage: write `total` bytes of newline-terminated text to stdout
+static int helper_gen (uint64_t total) {
+    static char block[GEN_BLOCK];
+    for (size_t i = 0; i < GEN_BLOCK; i++) block[i] = (i % 64 == 63) ? '\n' : (char)('a' + i % 26);
+    while (total > 0) {
+        size_t len = total < GEN_BLOCK ? (size_t)total : GEN_BLOCK;
+        ssize_t w = write(STDOUT_FILENO, block, len);
+        if (w < 0) { if (errno == EINTR) continue; perror("gen: write"); return 1; }
+        total -= (uint64_t)w;
+    }
+    return 0;
+}
+
+// counter stage: drain stdin and check that `expect` bytes arrived
+static int helper_count (uint64_t expect) {
+    static char block[GEN_BLOCK * 4];
+    uint64_t total = 0;
+    for (;;) {
+        ssize_t r = read(STDIN_FILENO, block, sizeof(block));
+        if (r < 0) { if (errno == EINTR) continue; perror("count: read"); return 1; }
+        if (r == 0) break;
+        total += (uint64_t)r;
+    }
+    if (total != expect) {
+        fprintf(stderr, "count: got %" PRIu64 " bytes, expected %" PRIu64 "\n", total, expect);
+        return 1;
+    }
+    return 0;
+}
+
+// busy CPU time of the whole host in nanoseconds (all but idle and iowait)
+static uint64_t host_busy_ns (void) {
+    FILE *f = fopen("/proc/stat", "r");
+    if (!f) return 0;
+    unsigned long long v[10] = { 0 };
+    int n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]);
+    fclose(f);
+    if (n < 4) return 0;
+    uint64_t busy = v[0] + v[1] + v[2] + v[5] + v[6] + v[7]; // user nice system irq softirq steal
+    return busy * (1000000000ull / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+static void bench_throughput_one (uint64_t bytes, int pipe_sz, int cats) {
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%s gen %" PRIu64, self_path, bytes);
+    for (int i = 0; i < cats; i++) len += snprintf(line + len, sizeof(line) - (size_t)len, " | cat");
+    len += snprintf(line + len, sizeof(line) - (size_t)len, " | %s count %" PRIu64 "\nexit\n", self_path, bytes);
+    if (strchr(line, '\n') - line >= MAX_LINE - 1) {
+        fprintf(stderr, "bench: pipeline with %d stages does not fit osh's %d byte line\n", cats + 2, MAX_LINE);
+        return;
+    }
+
+    char sz[32];
+    snprintf(sz, sizeof(sz), "%d", pipe_sz);
+    setenv("OSH_PIPE_SIZE", sz, 1);
+    uint64_t busy0 = host_busy_ns();
+    uint64_t ns = run_osh(line);
+    uint64_t busy = host_busy_ns() - busy0;
+    unsetenv("OSH_PIPE_SIZE");
+
+    double gbps = bytes / (ns / 1e9) / 1e9;
+    double cpu_per_byte = (double)busy / (double)bytes;
+    fprintf(csv, "throughput,%d,%d,%" PRIu64 ",%.6f,%.3f,%.4f\n", pipe_sz, cats + 2, bytes, ns / 1e9, gbps, cpu_per_byte);
+    printf("throughput pipe=%-8d stages=%-2d %8.3f GB/s %8.4f cpu-ns/byte\n", pipe_sz, cats + 2, gbps, cpu_per_byte);
+    fflush(stdout);
+}
+
+static void bench_throughput (uint64_t bytes) {
+    static const int pipe_sizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024 };
+    static const int cat_counts[] = { 0, 1, 2, 4 };
+    fprintf(csv, "suite,pipe_size,stages,bytes,total_sec,gb_per_sec,cpu_ns_per_byte\n");
+    for (size_t p = 0; p < sizeof(pipe_sizes) / sizeof(pipe_sizes[0]); p++) {
+        for (size_t c = 0; c < sizeof(cat_counts) / sizeof(cat_counts[0]); c++) {
+            bench_throughput_one(bytes, pipe_sizes[p], cat_counts[c]);
+        }
+    }
+}
+
+// --- GLOB ---
+#define GLOB_REPS 5
+
+// create dir/f000000.. once; a marker file records that it is complete
+static void glob_populate (const char *dir, long entries) {
+    char marker[PATH_MAX];
+    snprintf(marker, sizeof(marker), "%s/.populated_%ld", dir, entries);
+    if (access(marker, F_OK) == 0) return;
+
+    printf("glob: creating %ld files in %s ...\n", entries, dir);
+    fflush(stdout);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) { perror("mkdir"); exit(1); }
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) { perror("open(dir)"); exit(1); }
+    for (long i = 0; i < entries; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%06ld", i);
+        int fd = openat(dfd, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) { perror("openat"); exit(1); }
+        close(fd);
+    }
+    close(dfd);
+    int fd = open(marker, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) close(fd);
+}
+
+static void bench_glob (const char *dir, long entries) {
+    static const char *patterns[] = { "f012345", "f*12345", "f1234??", "f[0-4]*999", "x*" };
+    glob_populate(dir, entries);
+    fprintf(csv, "suite,strategy,param,ops,total_sec,usec_per_op,ops_per_sec\n");
+
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        char line[PATH_MAX + 64], label[64];
+        snprintf(line, sizeof(line), "echo %s/%s > /dev/null\n", dir, patterns[p]);
+        if (strlen(line) >= MAX_LINE) { fprintf(stderr, "bench: glob dir path too long for osh\n"); exit(1); }
+
+        char *script = repeat_line(line, GLOB_REPS);
+        snprintf(label, sizeof(label), "osh:%s", patterns[p]);
+        report("glob", label, (int)entries, GLOB_REPS, run_osh(script));
+        free(script);
+
+        // what we did before: a second shell expands the pattern
+        line[strlen(line) - 1] = '\0';
+        char *sh_argv[] = { "sh", "-c", line, NULL };
+        uint64_t t0 = now_ns();
+        for (int r = 0; r < GLOB_REPS; r++) {
+            pid_t pid = spawn_fork(sh_argv, STDIN_FILENO, STDOUT_FILENO);
+            if (pid < 0) { perror("spawn(sh)"); exit(1); }
+            waitpid(pid, NULL, 0);
+        }
+        snprintf(label, sizeof(label), "sh-c:%s", patterns[p]);
+        report("glob", label, (int)entries, GLOB_REPS, now_ns() - t0);
+    }
+}
+
+// --- MAIN ---
+static void usage (const char *prog) {
+    fprintf(stderr, "usage: %s [launch] [-n iterations] [--osh path]\n"
+                    "       %s throughput [-b bytes] [--osh path]\n"
+                    "       %s glob [-e entries] [-d dir] [--osh path]\n", prog, prog, prog);
+    exit(2);
+}
+
+int main (int argc, char **argv) {
+    // pipeline stages started by osh during the throughput suite
+    if (argc == 3 && strcmp(argv[1], "gen") == 0) return helper_gen(strtoull(argv[2], NULL, 10));
+    if (argc == 3 && strcmp(argv[1], "count") == 0) return helper_count(strtoull(argv[2], NULL, 10));
+
+    enum { S_LAUNCH, S_THROUGHPUT, S_GLOB } suite = S_LAUNCH;
+    long n = 2000, entries = 1000000;
+    uint64_t bytes = 1ull << 30;
+    const char *glob_dir = "/tmp/osh_glob_bench";
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "launch") == 0) i++;
+    else if (i < argc && strcmp(argv[i], "throughput") == 0) { suite = S_THROUGHPUT; i++; }
+    else if (i < argc && strcmp(argv[i], "glob") == 0) { suite = S_GLOB; i++; }
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            entries = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            glob_dir = argv[++i];
+        } else if (strcmp(argv[i], "--osh") == 0 && i + 1 < argc) {
+            osh_path = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (n < 1) n = 1;
+    if (bytes < 1) bytes = 1;
+    if (entries < 1) entries = 1;
+    if (access(osh_path, X_OK) != 0) { fprintf(stderr, "bench: %s: %s\n", osh_path, strerror(errno)); return 1; }
+
+    // osh has to find us again to start the gen/count stages
+    self_path = argv[0];
+    if (suite == S_THROUGHPUT && strchr(self_path, '/') == NULL) {
+        fprintf(stderr, "bench: run the throughput suite with a path, e.g. ./bench\n");
+        return 1;
+    }
+
+    // keep benchmark lines out of the user's history file
+    setenv("HISTFILE", "/dev/null", 1);
+
+    csv = fopen("bench_output.txt", "w");
+    if (!csv) { perror("fopen(bench_output.txt)"); return 1; }
+
+    if (suite == S_THROUGHPUT) {
+        bench_throughput(bytes);
+    } else if (suite == S_GLOB) {
+        bench_glob(glob_dir, entries);
+    } else {
+        fprintf(csv, "suite,strategy,param,ops,total_sec,usec_per_op,ops_per_sec\n");
+        bench_true_loop(n);
+        static const int stage_counts[] = { 1, 2, 4, 8 };
+        for (size_t s = 0; s < sizeof(stage_counts) / sizeof(stage_counts[0]); s++) {
+            bench_cat_pipeline(n / 4 > 0 ? n / 4 : 1, stage_counts[s]);
+        }
+        bench_background(n);
+    }
+
+    fclose(csv);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -9,6 +10,21 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#include <termios.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
 
 #define MAX_LINE 80   /* The maximum length command */
 #define MAX_ARGS (MAX_LINE / 2)
@@ -19,10 +35,16 @@
 typedef enum {
     T_EOF = 0,	// \0
     T_AMP,	// &
-    T_DBANG,	// !!
+    T_BANG,	// !!, !n, !-n, !?substring, !prefix
     T_OUT,	// >
     T_IN,	// <
+    T_HEREDOC,	// <<
+    T_HERESTR,	// <<<
     T_PIPE,	// |
+    T_SEMI,	// ;
+    T_DSEMI,	// ;; (ends a case arm)
+    T_AND,	// &&
+    T_OR,	// ||
     T_WORD	// words
 } TokKind;
 
@@ -71,19 +93,6 @@ static Token make_n_char_token (Lexer *lx, TokKind k, size_t n) {
     return tok;
 }
 
-typedef int (*pred_fn)(int ch);
-static size_t read_span_len (const Lexer *lx, pred_fn fn) {
-    int c0 = lex_peek(lx, 0);
-    if (c0 < 0 || !fn(c0)) return 0;
-    size_t offset = 0;
-    for (;;) {
-	int next = lex_peek(lx, offset + 1);
-	if (next < 0 || !fn(next)) break;
-	offset++;
-    }
-    return offset + 1;
-}
-
 static int is_ws (int c) { return (c == ' ') || (c == '\t') || (c == '\r'); }
 
 static void skip_ws (Lexer *lx) {
@@ -97,10 +106,45 @@ static void skip_ws (Lexer *lx) {
     }
 }
 
-static int is_word (int c) { return !(is_ws(c) || c == '&' || c == '>' || c == '<' || c == '|'); }
+// nothing but blanks left on the line
+static int lex_at_end (Lexer *lx) {
+    skip_ws(lx);
+    int c = lex_peek(lx, 0);
+    return c < 0 || c == '\n';
+}
+
+// only blanks before the current position: a history reference must start the line
+static int lex_line_start (const Lexer *lx) {
+    for (size_t i = 0; i < lx->pos; i++) if (!is_ws((unsigned char)lx->content[i])) return 0;
+    return 1;
+}
+
+static int is_word (int c) { return !(is_ws(c) || c == '&' || c == '>' || c == '<' || c == '|' || c == ';'); }
+
+/* a word, with any "$(...)" inside kept whole (spaces and operators
+ * included); a word may also be a whole ">(...)" or "<(...)" pipeline */
+static size_t word_span_len (const Lexer *lx) {
+    size_t n = 0;
+    for (int c; (c = lex_peek(lx, n)) >= 0; ) {
+        int paren = (c == '$' || ((c == '>' || c == '<') && n == 0)) && lex_peek(lx, n + 1) == '(';
+        if (!paren) {
+            if (!is_word(c)) break;
+            n++;
+            continue;
+        }
+        int depth = 0;
+        for (n++; (c = lex_peek(lx, n)) >= 0; n++) {
+            if (c == '(') depth++;
+            else if (c == ')' && --depth == 0) break;
+        }
+        if (c < 0) break;	// unterminated: rest of the line
+        n++;
+    }
+    return n;
+}
 
 static Token make_word_token (Lexer *lx) {
-    size_t len = read_span_len(lx, is_word);
+    size_t len = word_span_len(lx);
     const char *s = lx->content + lx->pos;
     Token tok = make_n_char_token(lx, T_WORD, len);
     tok.word = (char *)malloc(len + 1);
@@ -117,28 +161,58 @@ static Token next_token (Lexer *lx) {
 
     switch (c) {
         case '\n': return make_n_char_token(lx, T_EOF, 1); // treat as EOF for now (will be stripped at fgets)
-	case '&': return make_n_char_token(lx, T_AMP, 1);
+	case '&': return make_n_char_token(lx, lex_peek(lx, 1) == '&' ? T_AND : T_AMP, 1 + (lex_peek(lx, 1) == '&'));
+	case ';': return make_n_char_token(lx, lex_peek(lx, 1) == ';' ? T_DSEMI : T_SEMI, 1 + (lex_peek(lx, 1) == ';'));
 	case '!': {
 	    int next = lex_peek(lx, 1);
-	    if (next == '!') return make_n_char_token(lx, T_DBANG, 2);
-	    return make_word_token(lx);
+	    if (next == '!' && lex_line_start(lx)) {
+	        Token tok = make_n_char_token(lx, T_BANG, 2);
+	        tok.word = strdup("!");
+	        if (!tok.word) { perror("strdup(tok)"); exit(1); }
+	        return tok;
+	    }
+	    if (next < 0 || !is_word(next) || !lex_line_start(lx)) return make_word_token(lx);
+
+	    // "!?substring[?]" runs to the closing '?' or the end of the line
+	    if (next == '?') {
+	        size_t start = lx->pos + 1, len = 1;
+	        while (lex_peek(lx, 1 + len) >= 0 && lex_peek(lx, 1 + len) != '\n' && lex_peek(lx, 1 + len) != '?') len++;
+	        if (lex_peek(lx, 1 + len) == '?') len++;
+	        Token tok; tok_init(&tok, T_BANG, lx->pos, len + 1, NULL);
+	        tok.word = strndup(lx->content + start, len);
+	        if (!tok.word) { perror("strndup(tok)"); exit(1); }
+	        lex_advance(lx, len + 1);
+	        return tok;
+	    }
+
+	    // event designator is the rest of the word after '!'
+	    lex_advance(lx, 1);
+	    Token tok = make_word_token(lx);
+	    tok.kind = T_BANG;
+	    return tok;
 	}
-	case '>': return make_n_char_token(lx, T_OUT, 1);
-	case '<': return make_n_char_token(lx, T_IN, 1);
-	case '|': return make_n_char_token(lx, T_PIPE, 1);
+	case '>':
+	    if (lex_peek(lx, 1) == '(') return make_word_token(lx);
+	    return make_n_char_token(lx, T_OUT, 1);
+	case '<':
+	    if (lex_peek(lx, 1) == '(') return make_word_token(lx);
+	    if (lex_peek(lx, 1) != '<') return make_n_char_token(lx, T_IN, 1);
+	    if (lex_peek(lx, 2) == '<') return make_n_char_token(lx, T_HERESTR, 3);
+	    return make_n_char_token(lx, T_HEREDOC, 2);
+	case '|': return make_n_char_token(lx, lex_peek(lx, 1) == '|' ? T_OR : T_PIPE, 1 + (lex_peek(lx, 1) == '|'));
 	default: return make_word_token(lx);
     }
 }
 
 static void free_tok_word (Token *tok) {
-    if (tok->kind == T_WORD && tok->word) {
+    if ((tok->kind == T_WORD || tok->kind == T_BANG) && tok->word) {
         free(tok->word);
 	tok->word = NULL;
     }
 }
 
 // --- CMD PARSER ---
-typedef enum { R_NONE=0, R_IN, R_OUT } RedirKind;
+typedef enum { R_NONE=0, R_IN, R_OUT, R_HERE, R_CAT } RedirKind;	// R_CAT: "< FILE" taken over from cat (see PEEPHOLE)
 
 /* Example Structure:
  * "ls -l | less"
@@ -148,10 +222,14 @@ typedef struct Cmd Cmd;
 struct Cmd {
     char **argv;
     int argc;
+    int argcap;	// slots allocated in argv (grows during expansion)
     int is_background;
-    int uses_history;
+    char *hist_ref;	// history event designator ("!" for "!!"), whole line only
     char *redir_in_path;
     char *redir_out_path;
+    char *heredoc_delim;	// "<<WORD" until its body has been read
+    char *redir_in_data;	// here-doc body or "<<<" word, fed to stdin from a memfd
+    TokKind sep;	// what ended the statement: ;, ;;, &&, ||, & or the end of the line
     Cmd *pipe_cmd;
 };
 
@@ -159,21 +237,25 @@ static void cmd_init (Cmd *cmd) {
     cmd->argv = (char **)malloc(sizeof(char *) * (MAX_ARGS + 1));
     if (!cmd->argv) { perror("malloc(argv)"); exit(1); }
     cmd->argc = 0;
+    cmd->argcap = MAX_ARGS + 1;
     cmd->is_background = 0;
-    cmd->uses_history = 0;
+    cmd->hist_ref = NULL;
     cmd->redir_in_path = NULL;
     cmd->redir_out_path = NULL;
+    cmd->heredoc_delim = NULL;
+    cmd->redir_in_data = NULL;
+    cmd->sep = T_EOF;
     cmd->pipe_cmd = NULL;
 }
 
 static int parse_cmd (Lexer *lx, Cmd *out) {
     Token tok = next_token(lx);
 
-    // "!!" only, no junk after
-    if (tok.kind == T_DBANG) {
+    // "!!", "!n", "!-n", "!?substring" or "!prefix" only, no junk after
+    if (tok.kind == T_BANG) {
         Token t2 = next_token(lx);
-        if (t2.kind != T_EOF) { free_tok_word(&t2); return -2; }
-        out->uses_history = 1;
+        if (t2.kind != T_EOF) { free_tok_word(&tok); free_tok_word(&t2); return -2; }
+        out->hist_ref = tok.word;
         return 0;
     }
 
@@ -182,19 +264,25 @@ static int parse_cmd (Lexer *lx, Cmd *out) {
         if (tok.kind == T_WORD) {
             if (out->argc >= MAX_ARGS) { free_tok_word(&tok); return -1; }
             out->argv[out->argc++] = tok.word;
+
+            // "case WORD in" ends at "in": patterns follow on the same line
+            if (out->argc == 3 && out->pipe_cmd == NULL && strcmp(out->argv[0], "case") == 0 && strcmp(out->argv[2], "in") == 0) {
+                out->sep = T_SEMI;
+                break;
+            }
             tok = next_token(lx);
 	    continue;
         }
 	
 	// handle redirs
-	if (tok.kind == T_OUT || tok.kind == T_IN) {
+	if (tok.kind == T_OUT || tok.kind == T_IN || tok.kind == T_HEREDOC || tok.kind == T_HERESTR) {
             RedirKind rk = (tok.kind==T_OUT) ? R_OUT : R_IN;
 
 	    // sink with pipe can't also take a file input
-            if (tok.kind == T_IN && out->pipe_cmd != NULL) return -2;
+            if (rk == R_IN && out->pipe_cmd != NULL) return -2;
 
 	    // duplicate redirect
-	    if (tok.kind == T_IN && out->redir_in_path) return -2;
+	    if (rk == R_IN && (out->redir_in_path || out->heredoc_delim || out->redir_in_data)) return -2;
 	    if (tok.kind == T_OUT && out->redir_out_path) return -2;
 
             // expect filename
@@ -202,6 +290,14 @@ static int parse_cmd (Lexer *lx, Cmd *out) {
             if (t2.kind != T_WORD){ free_tok_word(&t2); return -2; }
 	    if (tok.kind == T_IN) out->redir_in_path = t2.word;
 	    if (tok.kind == T_OUT) out->redir_out_path = t2.word;
+	    if (tok.kind == T_HEREDOC) out->heredoc_delim = t2.word;
+	    if (tok.kind == T_HERESTR) {
+	        // a here-string is the word plus a newline
+	        size_t wl = strlen(t2.word);
+	        out->redir_in_data = (char *)realloc(t2.word, wl + 2);
+	        if (!out->redir_in_data) { perror("realloc(herestr)"); exit(1); }
+	        memcpy(out->redir_in_data + wl, "\n", 2);
+	    }
             tok = next_token(lx);
             continue;
 	}
@@ -209,7 +305,7 @@ static int parse_cmd (Lexer *lx, Cmd *out) {
         // handle pipes
         if (tok.kind == T_PIPE) {
 	    // lhs needs to exist
-	    if (out->argc == 0 && out->redir_in_path == NULL && out->redir_out_path == NULL) return -2;
+	    if (out->argc == 0 && out->redir_in_path == NULL && out->redir_out_path == NULL && out->heredoc_delim == NULL && out->redir_in_data == NULL) return -2;
 
 	    // piped command cannot output to a pipe and an output file
 	    if (out->redir_out_path != NULL) return -2;
@@ -233,25 +329,26 @@ static int parse_cmd (Lexer *lx, Cmd *out) {
 	    continue;
 	}
 
-        // '&' at the end means background process
-        if (tok.kind == T_AMP) {
-            out->is_background = 1;
-            tok = next_token(lx);
-
-            // must be end of line
-            if (tok.kind != T_EOF) { free_tok_word(&tok); return -2; }
-	    break;
+        // end of the statement: '&' also puts it in the background; the
+        // lexer is left on whatever follows for the next parse_cmd
+        if (tok.kind == T_AMP || tok.kind == T_SEMI || tok.kind == T_DSEMI || tok.kind == T_AND || tok.kind == T_OR || tok.kind == T_EOF) {
+            out->is_background = (tok.kind == T_AMP);
+            out->sep = tok.kind;
+            break;
         }
 
-
-	if (tok.kind == T_EOF) break;
-
 	// unsupported ???
+	free_tok_word(&tok);
 	return -2;
     }
 
     out->argv[out->argc] = NULL;
-    return (out->argc == 0 && out->redir_in_path == NULL && out->redir_out_path == NULL) ? 1 : 0;
+    int empty = (out->argc == 0 && out->redir_in_path == NULL && out->redir_out_path == NULL && out->heredoc_delim == NULL && out->redir_in_data == NULL);
+    if (!empty) return 0;
+
+    // "a |", "&& b" and "; &" have nothing to run
+    if (out->pipe_cmd != NULL || out->sep == T_AND || out->sep == T_OR || out->sep == T_AMP) return -2;
+    return 1;
 }
 
 // free string/arrays of a cmd
@@ -262,8 +359,14 @@ static void free_cmd_node (Cmd *cmd) {
     }
     free(cmd->redir_in_path);
     free(cmd->redir_out_path);
+    free(cmd->heredoc_delim);
+    free(cmd->redir_in_data);
+    free(cmd->hist_ref);
     cmd->redir_in_path = NULL;
     cmd->redir_out_path = NULL;
+    cmd->heredoc_delim = NULL;
+    cmd->redir_in_data = NULL;
+    cmd->hist_ref = NULL;
 
     free(cmd->argv);
     cmd->argv = NULL;
@@ -291,117 +394,4338 @@ static void free_cmd (Cmd *head) {
     free_cmd_node(head);
 }
 
-static void exec_cmd (Cmd *cmd) {
-    // pipe (there exists command we need to pipe input from)
-    if (cmd->pipe_cmd != NULL) {
-        int fd[2];
-	if (pipe(fd) == -1) { puts("Pipe failed."); free_cmd(cmd); exit(1); }
-	pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork(pipe)");
-            free_cmd(cmd);
-            exit(1);
-        } else if (pid == 0) {
-            // child
-	    if (dup2(fd[WRITE_END], STDOUT_FILENO) < 0) { perror("dup2(pipe_r)"); free_cmd(cmd); exit(1); }
-	    close(fd[READ_END]);
-	    close(fd[WRITE_END]);
-	    exec_cmd(cmd->pipe_cmd);
-	    exit(1); // just in case, idk
-        } else {
-            // parent
-	    if (dup2(fd[READ_END], STDIN_FILENO) < 0) { perror("dup2(pipe_r)"); free_cmd(cmd); exit(1); }
-	    close(fd[READ_END]);
-	    close(fd[WRITE_END]);
-	    signal(SIGCHLD, SIG_IGN);
-        }
-    }
-
-    // redir
-    if (cmd->redir_out_path != NULL) {
-        int out = open(cmd->redir_out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (out < 0){ perror("open(out)"); free_cmd(cmd); exit(1); }
-        if (dup2(out, STDOUT_FILENO) < 0) { perror("dup2(out)"); free_cmd(cmd); exit(1); }
-        close(out);
-    }
-    if (cmd->redir_in_path != NULL) {
-        int in = open(cmd->redir_in_path, O_RDONLY);
-        if (in < 0) { perror("open(in)"); free_cmd(cmd); exit(1); }
-        if (dup2(in, STDIN_FILENO) < 0) { perror("dup2(in)"); free_cmd(cmd); exit(1); }
-        close(in);
-    } 
-    
-    execvp(cmd->argv[0], cmd->argv);
-    
-    // if execvp doesn't replace the current (child) process image with the new program, throw an error
-    perror("execvp()");
-    free_cmd(cmd);
-    exit(1);
+// drop a leading prefix word (e.g. "perfstat") from the first stage of a pipeline
+static int strip_prefix (Cmd *head, const char *word) {
+    Cmd *first = head;
+    while (first->pipe_cmd) first = first->pipe_cmd;
+    if (first->argc == 0 || strcmp(first->argv[0], word) != 0) return 0;
+    free(first->argv[0]);
+    memmove(first->argv, first->argv + 1, sizeof(char *) * (size_t)first->argc);
+    first->argc--;
+    return 1;
 }
 
-// --- MAIN ---
-int main(void) {
-    char prev_buf[MAX_LINE] = "";
-    char buf[MAX_LINE];
+// append a word to argv, growing it; argv stays NULL terminated
+static void cmd_push_arg (Cmd *cmd, char *word) {
+    if (cmd->argc + 1 >= cmd->argcap) {
+        cmd->argcap *= 2;
+        cmd->argv = (char **)realloc(cmd->argv, sizeof(char *) * (size_t)cmd->argcap);
+        if (!cmd->argv) { perror("realloc(argv)"); exit(1); }
+    }
+    cmd->argv[cmd->argc++] = word;
+    cmd->argv[cmd->argc] = NULL;
+}
+
+// --- VARIABLES ---
+/* Shell variables and the exported environment share one open-addressing
+ * table (linear probing, backward-shift deletion). Each variable is a single
+ * "NAME=VALUE" allocation, so the envp handed to execve is just an array of
+ * those pointers; it is rebuilt lazily, only after an exported variable
+ * changed, and otherwise reused by every spawn. */
+typedef struct {
+    char *entry;	// "NAME=VALUE", NULL marks an empty slot
+    size_t name_len;
+    uint64_t hash;
+    int exported;
+} Var;
+
+typedef struct {
+    Var *slots;
+    size_t cap, used;
+    char **envp;
+    int envp_dirty;
+} VarTable;
+
+static VarTable vars;
+static int last_status = 0;	// $?
+
+extern char **environ;
+
+static uint64_t var_hash (const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;	// FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static int is_name_start (int c) { return isalpha(c) || c == '_'; }
+static int is_name_char (int c) { return isalnum(c) || c == '_'; }
+
+// slot holding name, or the empty slot where it would go
+static Var *var_slot (const VarTable *t, const char *name, size_t len, uint64_t h) {
+    size_t mask = t->cap - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask) {
+        Var *v = &t->slots[i];
+        if (v->entry == NULL) return v;
+        if (v->hash == h && v->name_len == len && memcmp(v->entry, name, len) == 0) return v;
+    }
+}
+
+static void vars_grow (VarTable *t) {
+    VarTable big = { NULL, t->cap ? t->cap * 2 : 64, t->used, t->envp, t->envp_dirty };
+    big.slots = (Var *)calloc(big.cap, sizeof(Var));
+    if (!big.slots) { perror("calloc(vars)"); exit(1); }
+    for (size_t i = 0; i < t->cap; i++) {
+        Var *v = &t->slots[i];
+        if (v->entry) *var_slot(&big, v->entry, v->name_len, v->hash) = *v;
+    }
+    free(t->slots);
+    *t = big;
+}
+
+static const char *var_get_n (const char *name, size_t len) {
+    if (vars.cap == 0) return NULL;
+    const Var *v = var_slot(&vars, name, len, var_hash(name, len));
+    return v->entry ? v->entry + v->name_len + 1 : NULL;
+}
+
+static const char *var_get (const char *name) { return var_get_n(name, strlen(name)); }
+
+// exported: 1/0 sets the flag, -1 keeps it (new variables are not exported)
+static void var_set (const char *name, size_t len, const char *value, int exported) {
+    if ((vars.used + 1) * 4 > vars.cap * 3) vars_grow(&vars);
+    uint64_t h = var_hash(name, len);
+    Var *v = var_slot(&vars, name, len, h);
+    if (v->entry == NULL) { vars.used++; v->exported = 0; }
+
+    size_t vlen = strlen(value);
+    char *entry = (char *)malloc(len + vlen + 2);
+    if (!entry) { perror("malloc(var)"); exit(1); }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+    free(v->entry);
+    v->entry = entry;
+    v->name_len = len;
+    v->hash = h;
+    int was_exported = v->exported;
+    if (exported >= 0) v->exported = exported;
+    if (was_exported || v->exported) vars.envp_dirty = 1;
+}
+
+static void var_unset (const char *name) {
+    if (vars.cap == 0) return;
+    size_t len = strlen(name), mask = vars.cap - 1;
+    Var *v = var_slot(&vars, name, len, var_hash(name, len));
+    if (v->entry == NULL) return;
+    if (v->exported) vars.envp_dirty = 1;
+    free(v->entry);
+    v->entry = NULL;
+    vars.used--;
+
+    // shift later members of the probe run back so lookups never stop early
+    size_t hole = (size_t)(v - vars.slots);
+    for (size_t i = (hole + 1) & mask; vars.slots[i].entry; i = (i + 1) & mask) {
+        size_t home = vars.slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            vars.slots[hole] = vars.slots[i];
+            vars.slots[i].entry = NULL;
+            hole = i;
+        }
+    }
+}
+
+static void vars_init (void) {
+    vars_grow(&vars);
+    for (char **e = environ; *e; e++) {
+        const char *eq = strchr(*e, '=');
+        if (eq) var_set(*e, (size_t)(eq - *e), eq + 1, 1);
+    }
+}
+
+static char **vars_envp (void) {
+    if (vars.envp && !vars.envp_dirty) return vars.envp;
+    size_t n = 0;
+    for (size_t i = 0; i < vars.cap; i++) n += vars.slots[i].entry && vars.slots[i].exported;
+    vars.envp = (char **)realloc(vars.envp, sizeof(char *) * (n + 1));
+    if (!vars.envp) { perror("realloc(envp)"); exit(1); }
+    n = 0;
+    for (size_t i = 0; i < vars.cap; i++) {
+        if (vars.slots[i].entry && vars.slots[i].exported) vars.envp[n++] = vars.slots[i].entry;
+    }
+    vars.envp[n] = NULL;
+    vars.envp_dirty = 0;
+    return vars.envp;
+}
+
+// length of the NAME in a leading "NAME=" assignment, 0 if word is not one
+static size_t assignment_len (const char *word) {
+    if (!is_name_start((unsigned char)word[0])) return 0;
+    size_t i = 1;
+    while (is_name_char((unsigned char)word[i])) i++;
+    return word[i] == '=' ? i : 0;
+}
+
+// --- GLOB ---
+/* A path component pattern is compiled once into ops (literal runs, '?',
+ * '*' and '[...]' sets as 256-bit maps) and matched with single-point star
+ * backtracking. Directories are read with raw getdents64 into a large
+ * buffer and d_type decides what is a directory, so no per-entry stat is
+ * needed except on filesystems that report DT_UNKNOWN (or for symlinks). */
+typedef enum { G_LIT, G_ANY, G_STAR, G_SET } GlobOpKind;
+
+typedef struct {
+    GlobOpKind kind;
+    size_t arg, len;	// G_LIT: offset/length in lits, G_SET: index in sets
+} GlobOp;
+
+typedef struct {
+    GlobOp *ops;
+    size_t nops;
+    char *lits;
+    uint8_t (*sets)[32];
+    int dot_ok;	// pattern itself starts with '.', so hidden names may match
+} GlobPat;
+
+static int has_glob_meta (const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) { s++; continue; }
+        if (*s == '*' || *s == '?' || *s == '[') return 1;
+    }
+    return 0;
+}
+
+// bracket expression at p ("[...]"); returns bytes consumed or 0 if unterminated
+static size_t glob_compile_set (const char *p, uint8_t set[32]) {
+    size_t i = 1;
+    int negate = (p[i] == '!' || p[i] == '^');
+    if (negate) i++;
+    memset(set, 0, 32);
+    int first = 1;
+    for (; p[i] && (p[i] != ']' || first); first = 0) {
+        unsigned char lo = (unsigned char)p[i], hi = lo;
+        if (p[i] == '\\' && p[i + 1]) lo = hi = (unsigned char)p[++i];
+        if (p[i + 1] == '-' && p[i + 2] && p[i + 2] != ']') { hi = (unsigned char)p[i + 2]; i += 2; }
+        for (unsigned c = lo; c <= hi; c++) set[c >> 3] |= (uint8_t)(1u << (c & 7));
+        i++;
+    }
+    if (p[i] != ']') return 0;
+    if (negate) for (int k = 0; k < 32; k++) set[k] = (uint8_t)~set[k];
+    set[0] &= (uint8_t)~1u;	// never match the terminator
+    return i + 1;
+}
 
+static void glob_compile (GlobPat *g, const char *pat) {
+    size_t n = strlen(pat);
+    g->ops = (GlobOp *)malloc(sizeof(GlobOp) * (n + 1));
+    g->lits = (char *)malloc(n + 1);
+    g->sets = (uint8_t (*)[32])malloc(32 * (n / 2 + 1));
+    if (!g->ops || !g->lits || !g->sets) { perror("malloc(glob)"); exit(1); }
+    g->nops = 0;
+    g->dot_ok = (pat[0] == '.');
+    size_t nlits = 0, nsets = 0;
+
+    for (size_t i = 0; i < n; ) {
+        GlobOp *last = g->nops ? &g->ops[g->nops - 1] : NULL;
+        if (pat[i] == '*') {
+            if (!last || last->kind != G_STAR) g->ops[g->nops++] = (GlobOp){ G_STAR, 0, 0 };
+            i++;
+            continue;
+        }
+        if (pat[i] == '?') { g->ops[g->nops++] = (GlobOp){ G_ANY, 0, 0 }; i++; continue; }
+        if (pat[i] == '[') {
+            size_t used = glob_compile_set(pat + i, g->sets[nsets]);
+            if (used) { g->ops[g->nops++] = (GlobOp){ G_SET, nsets++, 0 }; i += used; continue; }
+        }
+        // literal byte, merged into the previous literal run
+        if (pat[i] == '\\' && pat[i + 1]) i++;
+        if (last && last->kind == G_LIT) last->len++;
+        else g->ops[g->nops++] = (GlobOp){ G_LIT, nlits, 1 };
+        g->lits[nlits++] = pat[i++];
+    }
+}
+
+static void glob_free (GlobPat *g) {
+    free(g->ops);
+    free(g->lits);
+    free(g->sets);
+}
+
+static int glob_match (const GlobPat *g, const char *s) {
+    if (s[0] == '.' && !g->dot_ok) return 0;
+    size_t i = 0, star = (size_t)-1;
+    const char *star_s = NULL;
     for (;;) {
-	// get input
-        printf("osh> ");
-        fflush(stdout);
-        if (fgets(buf, MAX_LINE, stdin) == NULL) break;
+        if (i < g->nops) {
+            const GlobOp *op = &g->ops[i];
+            if (op->kind == G_STAR) { star = i++; star_s = s; continue; }
+            if (op->kind == G_ANY && *s) { i++; s++; continue; }
+            if (op->kind == G_SET && *s && (g->sets[op->arg][(unsigned char)*s >> 3] >> ((unsigned char)*s & 7) & 1)) { i++; s++; continue; }
+            if (op->kind == G_LIT && strncmp(s, g->lits + op->arg, op->len) == 0) { i++; s += op->len; continue; }
+        } else if (*s == '\0') {
+            return 1;
+        }
+        // mismatch: let the last '*' swallow one more byte
+        if (star == (size_t)-1 || *star_s == '\0') return 0;
+        s = ++star_s;
+        i = star + 1;
+    }
+}
 
-        // strip newline
-        buf[strcspn(buf, "\n")] = '\0';
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-	// empty line
-	if (buf[0] == '\0') continue;
+#define GETDENTS_BUF (256 * 1024)
 
-        // exit command
-        if (strcmp(buf, "exit") == 0) break;
+typedef struct {
+    char **paths;
+    size_t len, cap;
+} GlobOut;
 
-	// parse buffer
-	Cmd cmd; cmd_init(&cmd);
-	Lexer lx; lex_init(&lx, buf);
-	int p_res = parse_cmd(&lx, &cmd);
+static void glob_out_push (GlobOut *o, const char *path, size_t len) {
+    if (o->len == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 16;
+        o->paths = (char **)realloc(o->paths, sizeof(char *) * o->cap);
+        if (!o->paths) { perror("realloc(glob)"); exit(1); }
+    }
+    o->paths[o->len] = strndup(path, len);
+    if (!o->paths[o->len]) { perror("strndup(glob)"); exit(1); }
+    o->len++;
+}
 
-	if (p_res == 1) { free_cmd(&cmd); continue; } // empty
-	if (p_res == -1) { puts("Too many arguments."); free_cmd(&cmd); continue; }
-	if (p_res == -2) { puts("Syntax error."); free_cmd(&cmd); continue; }
+static int is_dir_at (int dfd, const char *name, unsigned char d_type) {
+    if (d_type == DT_DIR) return 1;
+    if (d_type != DT_UNKNOWN && d_type != DT_LNK) return 0;
+    struct stat st;
+    return fstatat(dfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
 
-	// history
-	if (cmd.uses_history) {
-	    if (prev_buf[0] == '\0') { puts("No commands in history."); free_cmd(&cmd); continue; }
-	    puts(prev_buf);
+static void glob_globstar (const char *base, size_t blen, char **rest, size_t nrest, int dirs_only, GlobOut *out);
 
-	    // relex and parsse w/ prev line
-	    lex_init(&lx, prev_buf);
-	    p_res = parse_cmd(&lx, &cmd);
-	    if (p_res != 0) { puts("Error parsing history."); free_cmd(&cmd); continue; }
-	} else {
-            strcpy(prev_buf, buf);
-	}
+/* Match comps[ci..] below the directory path[0..plen) ("" is the cwd).
+ * path has room for PATH_MAX bytes; dirs_only keeps directories only. */
+static void glob_walk (char *path, size_t plen, char **comps, size_t ncomps, size_t ci, int dirs_only, GlobOut *out) {
+    int last = (ci + 1 == ncomps);
+    const char *comp = comps[ci];
 
-        // empty
-        if (cmd.argc == 0) { free_cmd(&cmd); continue; }
+    // "**" matches any number of directories, walked in parallel
+    if (strcmp(comp, "**") == 0) {
+        glob_globstar(path, plen, comps + ci + 1, ncomps - ci - 1, dirs_only, out);
+        return;
+    }
 
-        // fork and execute
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork()");
-            free_cmd(&cmd);
-            exit(1);
-        } else if (pid == 0) {
-            // child
-	    exec_cmd(&cmd);
+    // literal component: no need to list the directory
+    if (!has_glob_meta(comp)) {
+        size_t clen = strlen(comp), w = 0;
+        if (plen + clen + 2 >= PATH_MAX) return;
+        for (size_t i = 0; i < clen; i++) {
+            if (comp[i] == '\\' && comp[i + 1]) i++;
+            path[plen + w++] = comp[i];
+        }
+        path[plen + w] = '\0';
+        struct stat st;
+        if (last) {
+            if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && (!dirs_only || stat(path, &st) == 0)) {
+                if (!dirs_only || S_ISDIR(st.st_mode)) glob_out_push(out, path, plen + w);
+            }
+        } else {
+            path[plen + w] = '/';
+            glob_walk(path, plen + w + 1, comps, ncomps, ci + 1, dirs_only, out);
+        }
+        return;
+    }
+
+    path[plen] = '\0';
+    int dfd = open(plen ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+
+    GlobPat g;
+    glob_compile(&g, comp);
+    char *dbuf = (char *)malloc(GETDENTS_BUF);
+    if (!dbuf) { perror("malloc(getdents)"); exit(1); }
+    for (;;) {
+        long n = syscall(SYS_getdents64, dfd, dbuf, GETDENTS_BUF);
+        if (n <= 0) break;
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dbuf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (!glob_match(&g, name)) continue;
+
+            size_t nlen = strlen(name);
+            if (plen + nlen + 2 >= PATH_MAX) continue;
+            if ((!last || dirs_only) && !is_dir_at(dfd, name, d->d_type)) continue;
+            memcpy(path + plen, name, nlen);
+            if (last) {
+                glob_out_push(out, path, plen + nlen);
+            } else {
+                path[plen + nlen] = '/';
+                glob_walk(path, plen + nlen + 1, comps, ncomps, ci + 1, dirs_only, out);
+            }
+        }
+    }
+    free(dbuf);
+    glob_free(&g);
+    close(dfd);
+}
+
+// --- PARALLEL GLOBSTAR ---
+/* "**" walks every directory below the base. Each directory is a work item;
+ * workers keep a deque of items, pop their own newest item (depth first,
+ * good locality) and steal the oldest item of another worker when they run
+ * dry, sleeping on a condition variable while nothing is queued. `pending`
+ * counts items queued or in progress, so the walk is over at zero. Every worker collects matches privately and
+ * glob_expand sorts the union, so argv does not depend on scheduling.
+ * Symlinked and hidden directories are not descended into. */
+#define GLOBSTAR_MAX_THREADS 32
+
+typedef struct {
+    pthread_mutex_t lock;
+    char **items;	// live items are items[top..bottom)
+    size_t top, bottom, cap;
+} WorkDeque;
+
+typedef struct GlobStar GlobStar;
+
+typedef struct {
+    GlobStar *gs;
+    size_t id;
+    GlobOut out;
+} StarWorker;
+
+struct GlobStar {
+    WorkDeque *deques;
+    StarWorker *workers;
+    size_t nworkers;
+    atomic_long pending;	// items queued or being visited
+    atomic_long queued;	// items sitting in some deque
+    atomic_int nidle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    char **rest;	// components after "**"
+    size_t nrest;
+    int dirs_only;
+    GlobPat pat;	// compiled rest[0] when it is the last component
+};
+
+// set while a thread is running globstar work, so nested "**" stays inline
+static __thread int in_globstar;
+
+static void deque_push (WorkDeque *dq, char *item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap) {
+        if (dq->top > 0) {
+            memmove(dq->items, dq->items + dq->top, sizeof(char *) * (dq->bottom - dq->top));
+            dq->bottom -= dq->top;
+            dq->top = 0;
         } else {
-            // parent
-            int status;
-            if (!cmd.is_background) waitpid(pid, &status, 0);
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->items = (char **)realloc(dq->items, sizeof(char *) * dq->cap);
+            if (!dq->items) { perror("realloc(deque)"); exit(1); }
+        }
+    }
+    dq->items[dq->bottom++] = item;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+// owner end (newest) or thief end (oldest)
+static char *deque_take (WorkDeque *dq, int steal) {
+    char *item = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top < dq->bottom) item = steal ? dq->items[dq->top++] : dq->items[--dq->bottom];
+    if (dq->top == dq->bottom) dq->top = dq->bottom = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return item;
+}
+
+static void globstar_push (GlobStar *gs, size_t id, char *dir) {
+    atomic_fetch_add(&gs->pending, 1);
+    deque_push(&gs->deques[id], dir);
+    atomic_fetch_add(&gs->queued, 1);
+    if (atomic_load(&gs->nidle) > 0) {
+        pthread_mutex_lock(&gs->idle_lock);
+        pthread_cond_signal(&gs->idle_cond);
+        pthread_mutex_unlock(&gs->idle_lock);
+    }
+}
+
+// list one directory: queue subdirectories, collect matches of the rest
+static void globstar_visit (StarWorker *w, const char *dir) {
+    GlobStar *gs = w->gs;
+    size_t dlen = strlen(dir);
+    int dfd = open(dlen ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+
+    char *path = (char *)malloc(PATH_MAX);
+    char *dbuf = (char *)malloc(GETDENTS_BUF);
+    if (!path || !dbuf) { perror("malloc(globstar)"); exit(1); }
+    memcpy(path, dir, dlen);
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, dfd, dbuf, GETDENTS_BUF);
+        if (n <= 0) break;
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dbuf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.') continue;
+            size_t nlen = strlen(name);
+            if (dlen + nlen + 2 >= PATH_MAX) continue;
+            memcpy(path + dlen, name, nlen);
+
+            // real directories only: DT_LNK is never followed, so no cycles
+            int is_dir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (is_dir) {
+                path[dlen + nlen] = '/';
+                char *sub = strndup(path, dlen + nlen + 1);
+                if (!sub) { perror("strndup(globstar)"); exit(1); }
+                globstar_push(gs, w->id, sub);
+            }
+
+            // "x/**" lists everything, "x/**/pat" matches pat in every directory
+            int want = (gs->nrest == 0) || (gs->nrest == 1 && glob_match(&gs->pat, name));
+            if (want && gs->dirs_only && !is_dir_at(dfd, name, d->d_type)) want = 0;
+            if (want) glob_out_push(&w->out, path, dlen + nlen);
+        }
+    }
+
+    // deeper patterns ("**/src/*.c") are matched from here sequentially
+    if (gs->nrest > 1) glob_walk(path, dlen, gs->rest, gs->nrest, 0, gs->dirs_only, &w->out);
+
+    free(dbuf);
+    free(path);
+    close(dfd);
+}
+
+static void *globstar_worker (void *arg) {
+    StarWorker *w = (StarWorker *)arg;
+    GlobStar *gs = w->gs;
+    in_globstar = 1;
+    unsigned victim = (unsigned)w->id;
+    while (atomic_load(&gs->pending) > 0) {
+        char *dir = deque_take(&gs->deques[w->id], 0);
+        for (size_t tries = 1; !dir && tries < gs->nworkers; tries++) {
+            victim = (victim + 1) % (unsigned)gs->nworkers;
+            if (victim != w->id) dir = deque_take(&gs->deques[victim], 1);
+        }
+        if (!dir) {
+            // nothing to steal: sleep until work is queued or the walk is over
+            pthread_mutex_lock(&gs->idle_lock);
+            atomic_fetch_add(&gs->nidle, 1);
+            while (atomic_load(&gs->queued) == 0 && atomic_load(&gs->pending) > 0) {
+                pthread_cond_wait(&gs->idle_cond, &gs->idle_lock);
+            }
+            atomic_fetch_sub(&gs->nidle, 1);
+            pthread_mutex_unlock(&gs->idle_lock);
+            continue;
+        }
+        atomic_fetch_sub(&gs->queued, 1);
+        globstar_visit(w, dir);
+        free(dir);
+        if (atomic_fetch_sub(&gs->pending, 1) == 1) {
+            pthread_mutex_lock(&gs->idle_lock);
+            pthread_cond_broadcast(&gs->idle_cond);
+            pthread_mutex_unlock(&gs->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+static size_t globstar_threads (void) {
+    if (in_globstar) return 1;
+    const char *env = var_get("OSH_GLOB_THREADS");
+    long n = 1;
+    cpu_set_t cpus;
+    if (env != NULL) n = atol(env);
+    else if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) n = CPU_COUNT(&cpus);
+    if (n < 1) n = 1;
+    if (n > GLOBSTAR_MAX_THREADS) n = GLOBSTAR_MAX_THREADS;
+    return (size_t)n;
+}
+
+static void glob_globstar (const char *base, size_t blen, char **rest, size_t nrest, int dirs_only, GlobOut *out) {
+    GlobStar gs;
+    gs.nworkers = globstar_threads();
+    gs.rest = rest;
+    gs.nrest = nrest;
+    gs.dirs_only = dirs_only;
+    if (nrest == 1) glob_compile(&gs.pat, rest[0]);
+    gs.deques = (WorkDeque *)calloc(gs.nworkers, sizeof(WorkDeque));
+    gs.workers = (StarWorker *)calloc(gs.nworkers, sizeof(StarWorker));
+    if (!gs.deques || !gs.workers) { perror("calloc(globstar)"); exit(1); }
+    for (size_t i = 0; i < gs.nworkers; i++) {
+        pthread_mutex_init(&gs.deques[i].lock, NULL);
+        gs.workers[i] = (StarWorker){ &gs, i, { NULL, 0, 0 } };
+    }
+
+    atomic_init(&gs.pending, 0);
+    atomic_init(&gs.queued, 0);
+    atomic_init(&gs.nidle, 0);
+    pthread_mutex_init(&gs.idle_lock, NULL);
+    pthread_cond_init(&gs.idle_cond, NULL);
+    char *root = strndup(base, blen);
+    if (!root) { perror("strndup(globstar)"); exit(1); }
+    globstar_push(&gs, 0, root);
+
+    // this thread is worker 0
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * gs.nworkers);
+    if (!tids) { perror("malloc(globstar)"); exit(1); }
+    size_t started = 1;
+    for (; started < gs.nworkers; started++) {
+        if (pthread_create(&tids[started], NULL, globstar_worker, &gs.workers[started]) != 0) break;
+    }
+    int was_in = in_globstar;
+    globstar_worker(&gs.workers[0]);
+    in_globstar = was_in;
+    for (size_t i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+    for (size_t i = 0; i < gs.nworkers; i++) {
+        GlobOut *wo = &gs.workers[i].out;
+        for (size_t j = 0; j < wo->len; j++) {
+            if (out->len == out->cap) {
+                out->cap = out->cap ? out->cap * 2 : 16;
+                out->paths = (char **)realloc(out->paths, sizeof(char *) * out->cap);
+                if (!out->paths) { perror("realloc(glob)"); exit(1); }
+            }
+            out->paths[out->len++] = wo->paths[j];
+        }
+        free(wo->paths);
+        free(gs.deques[i].items);
+        pthread_mutex_destroy(&gs.deques[i].lock);
+    }
+    if (nrest == 1) glob_free(&gs.pat);
+    pthread_cond_destroy(&gs.idle_cond);
+    pthread_mutex_destroy(&gs.idle_lock);
+    free(tids);
+    free(gs.workers);
+    free(gs.deques);
+}
+
+static int cmp_str (const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Expand word into cmd's argv in sorted order. Words that match nothing are
+ * kept literally (like sh); returns the number of words added. */
+static size_t glob_expand (Cmd *cmd, const char *word) {
+    size_t wlen = strlen(word);
+    char *pat = strdup(word);
+    char *path = (char *)malloc(PATH_MAX);
+    if (!pat || !path) { perror("malloc(glob)"); exit(1); }
+
+    // split into components; a leading '/' is the root, trailing ones mean dirs only
+    int dirs_only = 0;
+    while (wlen > 1 && pat[wlen - 1] == '/') { pat[--wlen] = '\0'; dirs_only = 1; }
+    size_t plen = 0;
+    char *rest = pat;
+    if (pat[0] == '/') { path[plen++] = '/'; rest++; }
+
+    char **comps = (char **)malloc(sizeof(char *) * (wlen + 1));
+    if (!comps) { perror("malloc(glob)"); exit(1); }
+    size_t ncomps = 0;
+    for (char *c = strtok(rest, "/"); c; c = strtok(NULL, "/")) {
+        // "**/**" is the same as "**"
+        if (ncomps > 0 && strcmp(c, "**") == 0 && strcmp(comps[ncomps - 1], "**") == 0) continue;
+        comps[ncomps++] = c;
+    }
+
+    GlobOut out = { NULL, 0, 0 };
+    if (ncomps > 0) glob_walk(path, plen, comps, ncomps, 0, dirs_only, &out);
+
+    size_t added = out.len;
+    if (out.len == 0) {
+        char *lit = strdup(word);
+        if (!lit) { perror("strdup(glob)"); exit(1); }
+        cmd_push_arg(cmd, lit);
+        added = 1;
+    } else {
+        qsort(out.paths, out.len, sizeof(char *), cmp_str);
+        for (size_t i = 0; i < out.len; i++) {
+            if (dirs_only) {
+                size_t l = strlen(out.paths[i]);
+                out.paths[i] = (char *)realloc(out.paths[i], l + 2);
+                if (!out.paths[i]) { perror("realloc(glob)"); exit(1); }
+                strcpy(out.paths[i] + l, "/");
+            }
+            cmd_push_arg(cmd, out.paths[i]);
+        }
+    }
+    free(out.paths);
+    free(comps);
+    free(path);
+    free(pat);
+    return added;
+}
+
+// --- EXPANSION ---
+typedef struct {
+    char *p;
+    size_t len, cap;
+} Str;
+
+static void str_putn (Str *s, const char *src, size_t n) {
+    if (s->len + n + 1 > s->cap) {
+        while (s->len + n + 1 > s->cap) s->cap = s->cap ? s->cap * 2 : 64;
+        s->p = (char *)realloc(s->p, s->cap);
+        if (!s->p) { perror("realloc(str)"); exit(1); }
+    }
+    memcpy(s->p + s->len, src, n);
+    s->len += n;
+    s->p[s->len] = '\0';
+}
+
+static void str_putc (Str *s, char c) { str_putn(s, &c, 1); }
+
+static void command_subst (const char *src, size_t len, Str *out);
+typedef struct Program Program;
+static int compile_line (Program *p, const char *line);
+
+// length of "$(...)" at word (pointing at '$'), 0 when unterminated
+static size_t subst_len (const char *word) {
+    int depth = 0;
+    for (size_t n = 1; word[n]; n++) {
+        if (word[n] == '(') depth++;
+        else if (word[n] == ')' && --depth == 0) return n + 1;
+    }
+    return 0;
+}
+
+/* Parameter at word[*i] (pointing at '$'): $NAME, ${NAME}, $?, $$ or $(...).
+ * Returns its value (never NULL) using scratch for numbers and capture for
+ * command output and advances *i, or NULL when the '$' does not start one. */
+static const char *expand_param (const char *word, size_t *i, char scratch[32], Str *capture) {
+    const char *p = word + *i + 1;
+    if (*p == '(') {
+        size_t len = subst_len(word + *i);
+        if (len == 0) return NULL;
+        capture->len = 0;
+        command_subst(p + 1, len - 3, capture);
+        *i += len;
+        return capture->p;
+    }
+    if (*p == '?') { snprintf(scratch, 32, "%d", last_status); *i += 2; return scratch; }
+    if (*p == '$') { snprintf(scratch, 32, "%d", (int)getpid()); *i += 2; return scratch; }
+
+    int braced = (*p == '{');
+    if (braced) p++;
+    if (!is_name_start((unsigned char)*p)) return NULL;
+    size_t len = 1;
+    while (is_name_char((unsigned char)p[len])) len++;
+    if (braced && p[len] != '}') return NULL;
+
+    const char *val = var_get_n(p, len);
+    *i = (size_t)(p - word) + len + braced;
+    return val ? val : "";
+}
+
+static int is_ifs (int c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+static void push_field (Cmd *out, Str *field) {
+    if (has_glob_meta(field->p)) {
+        glob_expand(out, field->p);
+        free(field->p);
+    } else {
+        cmd_push_arg(out, field->p);
+    }
+    *field = (Str){ NULL, 0, 0 };
+}
+
+/* Expand parameters in word and push the resulting fields to out: values are
+ * split on whitespace and every field is glob expanded. An assignment word
+ * ("NAME=...") is never split or globbed, and a word that expands to
+ * nothing at all produces no field. */
+static void expand_word (Cmd *out, const char *word) {
+    int split = (assignment_len(word) == 0);
+    Str field = { NULL, 0, 0 };
+    int have = 0;	// field has content (possibly empty literal)
+    char scratch[32];
+    Str capture = { NULL, 0, 0 };
+    for (size_t i = 0; word[i]; ) {
+        if (word[i] == '\\' && word[i + 1] == '$') { str_putc(&field, '$'); have = 1; i += 2; continue; }
+        const char *val = (word[i] == '$') ? expand_param(word, &i, scratch, &capture) : NULL;
+        if (val == NULL) { str_putc(&field, word[i++]); have = 1; continue; }
+        for (; *val; val++) {
+            if (split && is_ifs((unsigned char)*val)) {
+                if (have) { str_putn(&field, "", 0); push_field(out, &field); have = 0; }
+                continue;
+            }
+            str_putc(&field, *val);
+            have = 1;
+        }
+    }
+    free(capture.p);
+    if (!have) { free(field.p); return; }
+    str_putn(&field, "", 0);
+    if (!split) { cmd_push_arg(out, field.p); return; }
+    push_field(out, &field);
+}
+
+// expand parameters only, as one string (redirect targets)
+static char *expand_string (const char *word) {
+    Str s = { NULL, 0, 0 };
+    char scratch[32];
+    Str capture = { NULL, 0, 0 };
+    str_putn(&s, "", 0);
+    for (size_t i = 0; word[i]; ) {
+        if (word[i] == '\\' && word[i + 1] == '$') { str_putc(&s, '$'); i += 2; continue; }
+        const char *val = (word[i] == '$') ? expand_param(word, &i, scratch, &capture) : NULL;
+        if (val == NULL) str_putc(&s, word[i++]);
+        else str_putn(&s, val, strlen(val));
+    }
+    free(capture.p);
+    return s.p;
+}
+
+// --- BRACES ---
+/* Brace expansion is a generator: alternatives and range values are written
+ * into one reusable prefix buffer and every finished word goes straight to
+ * the next expansion step and into argv, so "{1..1000000}" never builds an
+ * intermediate list and costs one allocation per resulting word. */
+typedef struct {
+    long from, to, step;
+    int is_char;
+    int width;	// zero padding, 0 for none
+} BraceRange;
+
+// "a..b" or "a..b..step" between the braces; numbers or single characters
+static int brace_range_parse (char *body, BraceRange *r) {
+    char *dots = strstr(body, "..");
+    if (!dots) return 0;
+    *dots = '\0';
+    char *lo = body, *hi = dots + 2, *st = strstr(hi, "..");
+    if (st) { *st = '\0'; st += 2; }
+    r->step = 1;
+    if (st) {
+        char *end;
+        r->step = labs(strtol(st, &end, 10));
+        if (*st == '\0' || *end != '\0') return 0;
+        if (r->step == 0) r->step = 1;
+    }
+
+    if (strlen(lo) == 1 && strlen(hi) == 1 && !isdigit((unsigned char)*lo) && !isdigit((unsigned char)*hi)) {
+        r->is_char = 1;
+        r->width = 0;
+        r->from = (unsigned char)*lo;
+        r->to = (unsigned char)*hi;
+        return isalpha((unsigned char)*lo) && isalpha((unsigned char)*hi);
+    }
+
+    char *e1, *e2;
+    r->is_char = 0;
+    r->from = strtol(lo, &e1, 10);
+    r->to = strtol(hi, &e2, 10);
+    if (*lo == '\0' || *hi == '\0' || *e1 != '\0' || *e2 != '\0') return 0;
+    // a leading zero on either end pads every value to the longer width
+    int pad = (lo[lo[0] == '-'] == '0' && lo[(lo[0] == '-') + 1]) || (hi[hi[0] == '-'] == '0' && hi[(hi[0] == '-') + 1]);
+    size_t w = strlen(lo) > strlen(hi) ? strlen(lo) : strlen(hi);
+    r->width = pad ? (int)w : 0;
+    return 1;
+}
+
+// the len bytes at s, parsed from a copy (on the stack unless the body is long)
+static int brace_range (const char *s, size_t len, BraceRange *r) {
+    char small[128];
+    char *body = len < sizeof(small) ? small : malloc(len + 1);
+    if (!body) { perror("malloc(brace)"); exit(1); }
+    memcpy(body, s, len);
+    body[len] = '\0';
+    int ok = brace_range_parse(body, r);
+    if (body != small) free(body);
+    return ok;
+}
+
+/* Find the first brace group in s that expands: a top-level comma list or a
+ * valid range. "${...}" and backslash-escaped braces are skipped. */
+static int brace_find (const char *s, size_t *open, size_t *close, int *is_list) {
+    for (size_t i = 0; s[i]; i++) {
+        if (s[i] == '\\' && s[i + 1]) { i++; continue; }
+        if (s[i] == '$' && s[i + 1] == '{') {
+            const char *end = strchr(s + i, '}');
+            if (!end) return 0;
+            i = (size_t)(end - s);
+            continue;
+        }
+        if (s[i] == '$' && s[i + 1] == '(') {
+            size_t len = subst_len(s + i);
+            if (len == 0) return 0;
+            i += len - 1;
+            continue;
+        }
+        if (s[i] != '{') continue;
+
+        int depth = 0, comma = 0;
+        for (size_t j = i; s[j]; j++) {
+            if (s[j] == '\\' && s[j + 1]) { j++; continue; }
+            if (s[j] == '{') depth++;
+            else if (s[j] == ',' && depth == 1) comma = 1;
+            else if (s[j] == '}' && --depth == 0) {
+                BraceRange r;
+                if (comma || brace_range(s + i + 1, j - i - 1, &r)) {
+                    *open = i;
+                    *close = j;
+                    *is_list = comma;
+                    return 1;
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+static void expand_word (Cmd *out, const char *word);
+
+// one finished word: on to parameter/glob expansion
+static void brace_emit (Cmd *out, const char *word) {
+    // escaped braces and commas stay literal and lose the backslash, as "\$" does
+    char *w = strdup(word);
+    if (!w) { perror("strdup(brace)"); exit(1); }
+    size_t n = 0;
+    for (size_t i = 0; word[i]; i++) {
+        if (word[i] == '\\' && (word[i + 1] == '{' || word[i + 1] == '}' || word[i + 1] == ',')) i++;
+        w[n++] = word[i];
+    }
+    w[n] = '\0';
+
+    if (strchr(w, '$') == NULL && !has_glob_meta(w)) {
+        cmd_push_arg(out, w);
+    } else {
+        expand_word(out, w);
+        free(w);
+    }
+}
+
+// expand prefix + rest, where prefix holds no more brace groups
+static void brace_gen (Cmd *out, Str *prefix, const char *rest) {
+    size_t open, close, mark = prefix->len;
+    int is_list;
+    if (!brace_find(rest, &open, &close, &is_list)) {
+        str_putn(prefix, rest, strlen(rest));
+        brace_emit(out, prefix->p);
+        prefix->len = mark;
+        prefix->p[mark] = '\0';
+        return;
+    }
+
+    str_putn(prefix, rest, open);
+    size_t base = prefix->len;
+    const char *after = rest + close + 1;
 
-            // reap foreground children (no zombies)
-            while (waitpid(-1, NULL, WNOHANG) > 0) { /* reaped one child */ }
-            free_cmd(&cmd);
+    if (!is_list) {
+        BraceRange r;
+        brace_range(rest + open + 1, close - open - 1, &r);
+        long dir = (r.from <= r.to) ? r.step : -r.step;
+        for (long v = r.from; dir > 0 ? v <= r.to : v >= r.to; v += dir) {
+            char num[32];
+            int n = r.is_char ? snprintf(num, sizeof(num), "%c", (char)v)
+                              : snprintf(num, sizeof(num), "%0*ld", r.width, v);
+            str_putn(prefix, num, (size_t)n);
+            brace_gen(out, prefix, after);
+            prefix->len = base;
+            prefix->p[base] = '\0';
         }
+    } else {
+        // split on top-level commas; alternatives may hold nested groups
+        size_t start = open + 1;
+        int depth = 0;
+        for (size_t j = open + 1; j <= close; j++) {
+            if (rest[j] == '\\' && j + 1 < close) { j++; continue; }
+            if (rest[j] == '{') { depth++; continue; }
+            if (rest[j] == '}' && depth > 0) { depth--; continue; }
+            if (!(j == close || (rest[j] == ',' && depth == 0))) continue;
+
+            const char *alt = rest + start;
+            size_t alen = j - start;
+            if (memchr(alt, '{', alen) == NULL) {
+                str_putn(prefix, alt, alen);
+                brace_gen(out, prefix, after);
+            } else {
+                // nested group: rescan alternative + remainder together
+                Str joined = { NULL, 0, 0 };
+                str_putn(&joined, alt, alen);
+                str_putn(&joined, after, strlen(after));
+                brace_gen(out, prefix, joined.p);
+                free(joined.p);
+            }
+            prefix->len = base;
+            prefix->p[base] = '\0';
+            start = j + 1;
+        }
+    }
+    prefix->len = mark;
+    prefix->p[mark] = '\0';
+}
+
+// ">(pipeline)" and "<(pipeline)" are expanded when started, not here
+static int is_procsub (const char *word) {
+    return (word[0] == '>' || word[0] == '<') && word[1] == '(';
+}
+
+static int has_brace (const char *word) {
+    return strchr(word, '{') != NULL && assignment_len(word) == 0 && !is_procsub(word);
+}
+
+static int needs_expansion (const char *word) {
+    if (is_procsub(word)) return 0;
+    return strchr(word, '$') != NULL || strchr(word, '{') != NULL || has_glob_meta(word);
+}
+
+static void expand_path (char **path) {
+    if (*path == NULL || strchr(*path, '$') == NULL) return;
+    char *e = expand_string(*path);
+    free(*path);
+    *path = e;
+}
+
+// rewrite each stage's argv and redirect targets with expansions applied
+static void expand_cmd (Cmd *head) {
+    for (Cmd *node = head; node; node = node->pipe_cmd) {
+        expand_path(&node->redir_in_path);
+        expand_path(&node->redir_out_path);
+        expand_path(&node->redir_in_data);
+
+        int any = 0;
+        for (int i = 0; i < node->argc; i++) any |= needs_expansion(node->argv[i]);
+        if (!any) continue;
+
+        Cmd words;
+        cmd_init(&words);
+        for (int i = 0; i < node->argc; i++) {
+            if (has_brace(node->argv[i])) {
+                Str prefix = { NULL, 0, 0 };
+                str_putn(&prefix, "", 0);
+                brace_gen(&words, &prefix, node->argv[i]);
+                free(prefix.p);
+                free(node->argv[i]);
+            } else if (needs_expansion(node->argv[i])) {
+                expand_word(&words, node->argv[i]);
+                free(node->argv[i]);
+            } else {
+                cmd_push_arg(&words, node->argv[i]);
+            }
+        }
+        free(node->argv);
+        node->argv = words.argv;
+        node->argc = words.argc;
+        node->argcap = words.argcap;
+    }
+}
+
+// --- STATS ---
+/* HDR-style log-linear histogram of nanosecond samples: values below HIST_SUB
+ * get a bucket each, above that every power of two is split into HIST_HALF
+ * linear sub-buckets, so the relative error stays under 1/HIST_HALF (~1.6%) */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+typedef struct {
+    const char *name;
+    uint64_t count, min, max;
+    uint64_t buckets[HIST_BUCKETS];
+} Hist;
+
+static Hist h_parse = { .name = "parse" };
+static Hist h_spawn = { .name = "spawn" };
+static Hist h_expand = { .name = "expand" };
+static Hist h_wall = { .name = "wall" };
+static uint64_t procs_saved = 0;	// by pipeline rewrites (see PEEPHOLE)
+
+// see MEMO; main moves these into a shared page, since memo also runs in forked pipeline stages
+typedef struct { _Atomic uint64_t hits, misses; } MemoCounts;
+static MemoCounts memo_local;
+static MemoCounts *memo_counts = &memo_local;
+
+static uint64_t now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t hist_index (uint64_t v) {
+    if (v < HIST_SUB) return (size_t)v;
+    int shift = (63 - __builtin_clzll(v)) - (HIST_SUB_BITS - 1);
+    return HIST_SUB + (size_t)(shift - 1) * HIST_HALF + (size_t)((v >> shift) - HIST_HALF);
+}
+
+// highest value that still lands in bucket idx
+static uint64_t hist_bucket_max (size_t idx) {
+    if (idx < HIST_SUB) return idx;
+    size_t k = idx - HIST_SUB;
+    int shift = (int)(k / HIST_HALF) + 1;
+    uint64_t top = (uint64_t)(k % HIST_HALF) + HIST_HALF;
+    return (top << shift) + ((1ull << shift) - 1);
+}
+
+static void hist_record (Hist *h, uint64_t v) {
+    if (h->count == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->count++;
+    h->buckets[hist_index(v)]++;
+}
+
+static uint64_t hist_percentile (const Hist *h, double pct) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_max(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static void hist_print (const Hist *h) {
+    printf("%-8s %8llu %10.1f %10.1f %10.1f %10.1f\n", h->name, (unsigned long long)h->count,
+           hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+           hist_percentile(h, 99) / 1e3, h->max / 1e3);
+}
+
+// --- PERFSTAT ---
+/* Counters are opened on the shell itself with inherit=1 and only enabled
+ * around the fork/wait of one command, so every process of the pipeline
+ * (children of children included) folds its counts back into ours on exit. */
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} PerfCounter;
+
+static PerfCounter perf_counters[] = {
+    { "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,       -1 },
+    { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1 },
+    { "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,      -1 },
+    { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       -1 },
+    { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     -1 },
+    { "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     -1 },
+};
+#define N_PERF_COUNTERS (sizeof(perf_counters) / sizeof(perf_counters[0]))
+
+static int perf_open (PerfCounter *pc, int exclude_kernel) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = pc->type;
+    attr.config = pc->config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = exclude_kernel;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// returns the number of counters opened; hardware ones are optional
+static int perf_open_all (void) {
+    int opened = 0, err = 0;
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        PerfCounter *pc = &perf_counters[i];
+        pc->fd = perf_open(pc, 0);
+        // perf_event_paranoid may only allow user-space counting
+        if (pc->fd < 0 && (errno == EACCES || errno == EPERM)) pc->fd = perf_open(pc, 1);
+        if (pc->fd < 0) { err = errno; continue; }
+        opened++;
+    }
+    if (opened == 0) fprintf(stderr, "perfstat: perf_event_open: %s, running without counters\n", strerror(err));
+    return opened;
+}
+
+static void perf_ioctl_all (unsigned long req) {
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        if (perf_counters[i].fd >= 0) ioctl(perf_counters[i].fd, req, 0);
+    }
+}
+
+static void perf_report (const char *label, uint64_t wall_ns) {
+    fprintf(stderr, "\n Performance counter stats for '%s':\n\n", label);
+    for (size_t i = 0; i < N_PERF_COUNTERS; i++) {
+        PerfCounter *pc = &perf_counters[i];
+        uint64_t vals[3]; // value, time enabled, time running
+        if (pc->fd < 0 || read(pc->fd, vals, sizeof(vals)) != (ssize_t)sizeof(vals)) {
+            fprintf(stderr, "%20s      %s\n", "<not supported>", pc->name);
+        } else {
+            // scale up if the counter was multiplexed with others
+            double v = (double)vals[0];
+            if (vals[2] > 0 && vals[2] < vals[1]) v *= (double)vals[1] / (double)vals[2];
+            if (pc->config == PERF_COUNT_SW_TASK_CLOCK && pc->type == PERF_TYPE_SOFTWARE) {
+                fprintf(stderr, "%20.2f msec %s\n", v / 1e6, pc->name);
+            } else {
+                fprintf(stderr, "%20.0f      %s\n", v, pc->name);
+            }
+        }
+        if (pc->fd >= 0) close(pc->fd);
+        pc->fd = -1;
+    }
+    fprintf(stderr, "\n%20.6f seconds time elapsed\n\n", wall_ns / 1e9);
+}
+
+// --- TRIGRAM INDEX ---
+/* Maps every 3-byte substring of the history lines to the ascending list of
+ * entry numbers containing it (open addressing, linear probing). Lists only
+ * ever get appended to; numbers of evicted entries are trimmed off the front
+ * lazily, when a list would otherwise have to grow. */
+typedef struct {
+    uint32_t key;	// trigram + 1, 0 marks an empty slot
+    uint32_t head, len, cap;	// live postings are nums[head..len)
+    uint32_t *nums;
+} Posting;
+
+typedef struct {
+    Posting *slots;
+    size_t cap, used;
+} TriIndex;
+
+static uint32_t tri_key (const char *s) {
+    return (((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (unsigned char)s[2]) + 1;
+}
+
+static Posting *tri_slot (const TriIndex *ix, uint32_t key) {
+    size_t mask = ix->cap - 1;
+    for (size_t i = (key * 0x9e3779b1u) & mask; ; i = (i + 1) & mask) {
+        if (ix->slots[i].key == key || ix->slots[i].key == 0) return &ix->slots[i];
+    }
+}
+
+static const Posting *tri_find (const TriIndex *ix, const char *s) {
+    if (ix->cap == 0) return NULL;
+    const Posting *p = tri_slot(ix, tri_key(s));
+    return p->key ? p : NULL;
+}
+
+static void tri_grow (TriIndex *ix) {
+    TriIndex big = { NULL, ix->cap ? ix->cap * 2 : 1024, ix->used };
+    big.slots = (Posting *)calloc(big.cap, sizeof(Posting));
+    if (!big.slots) { perror("calloc(trigram)"); exit(1); }
+    for (size_t i = 0; i < ix->cap; i++) {
+        if (ix->slots[i].key) *tri_slot(&big, ix->slots[i].key) = ix->slots[i];
+    }
+    free(ix->slots);
+    *ix = big;
+}
+
+// index entry `num`; postings below `first` belong to evicted entries
+static void tri_add (TriIndex *ix, const char *line, uint32_t num, uint32_t first) {
+    size_t len = strlen(line);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if ((ix->used + 1) * 10 > ix->cap * 7) tri_grow(ix);
+        uint32_t key = tri_key(line + i);
+        Posting *p = tri_slot(ix, key);
+        if (p->key == 0) { p->key = key; ix->used++; }
+        if (p->len > p->head && p->nums[p->len - 1] == num) continue; // repeated in this line
+
+        if (p->len == p->cap) {
+            while (p->head < p->len && p->nums[p->head] < first) p->head++;
+            if (p->head > 0) {
+                memmove(p->nums, p->nums + p->head, sizeof(uint32_t) * (p->len - p->head));
+                p->len -= p->head;
+                p->head = 0;
+            }
+        }
+        if (p->len == p->cap) {
+            p->cap = p->cap ? p->cap * 2 : 4;
+            p->nums = (uint32_t *)realloc(p->nums, sizeof(uint32_t) * p->cap);
+            if (!p->nums) { perror("realloc(trigram)"); exit(1); }
+        }
+        p->nums[p->len++] = num;
+    }
+}
+
+// --- HISTORY ---
+/* Entries are stored back to back ('\0' terminated) in one byte arena used
+ * as a ring, and ents[(num - 1) % cap] maps a history number to its offset,
+ * so lookup by number is O(1) and adding an entry never mallocs. The oldest
+ * entries are evicted when either the index or the arena runs out of room. */
+#define HIST_DEFAULT_SIZE 500
+
+typedef struct { size_t off, len; } HistEnt;
+
+typedef struct {
+    char *arena;
+    size_t arena_cap;
+    size_t head;	// arena offset for the next entry
+    HistEnt *ents;
+    size_t cap;
+    uint64_t first;	// number of the oldest live entry
+    uint64_t next;	// number the next entry will get
+    TriIndex trigrams;	// substring index over the live entries
+} History;
+
+static History history;
+
+static void history_init (History *h, size_t cap) {
+    if (cap < 1) cap = 1;
+    h->cap = cap;
+    h->arena_cap = cap * MAX_LINE;
+    h->arena = (char *)malloc(h->arena_cap);
+    h->ents = (HistEnt *)malloc(sizeof(HistEnt) * cap);
+    if (!h->arena || !h->ents) { perror("malloc(history)"); exit(1); }
+    h->head = 0;
+    h->first = h->next = 1;
+    h->trigrams = (TriIndex){ NULL, 0, 0 };
+}
+
+static const char *history_get (const History *h, uint64_t num) {
+    if (num < h->first || num >= h->next) return NULL;
+    return h->arena + h->ents[(num - 1) % h->cap].off;
+}
+
+static void history_add (History *h, const char *line) {
+    size_t len = strlen(line);
+    if (len + 1 > h->arena_cap) return;
+    if (h->head + len + 1 > h->arena_cap) h->head = 0;
+
+    // drop the oldest entries while the index is full or they sit where we write
+    while (h->first < h->next) {
+        const HistEnt *old = &h->ents[(h->first - 1) % h->cap];
+        int full = h->next - h->first >= h->cap;
+        int overlaps = old->off < h->head + len + 1 && h->head < old->off + old->len + 1;
+        if (!full && !overlaps) break;
+        h->first++;
+    }
+
+    HistEnt *e = &h->ents[(h->next - 1) % h->cap];
+    e->off = h->head;
+    e->len = len;
+    memcpy(h->arena + e->off, line, len + 1);
+    h->head += len + 1;
+    tri_add(&h->trigrams, line, (uint32_t)h->next, (uint32_t)h->first);
+    h->next++;
+}
+
+// newest entry numbered below `before` that contains q, 0 if there is none
+static uint64_t history_search (const History *h, const char *q, uint64_t before) {
+    size_t qlen = strlen(q);
+    if (before > h->next) before = h->next;
+
+    // too short for a trigram: plain scan, newest first
+    if (qlen < 3) {
+        for (uint64_t num = before; num-- > h->first; ) {
+            if (strstr(history_get(h, num), q)) return num;
+        }
+        return 0;
+    }
+
+    // walk the shortest posting list among q's trigrams and verify candidates
+    const Posting *best = NULL;
+    for (size_t i = 0; i + 3 <= qlen; i++) {
+        const Posting *p = tri_find(&h->trigrams, q + i);
+        if (p == NULL) return 0;
+        if (best == NULL || p->len - p->head < best->len - best->head) best = p;
+    }
+    for (uint32_t j = best->len; j-- > best->head; ) {
+        uint64_t num = best->nums[j];
+        if (num >= before) continue;
+        if (num < h->first) break;
+        if (strstr(history_get(h, num), q)) return num;
+    }
+    return 0;
+}
+
+// resolve an event designator ("!", "n", "-n", "?substring[?]" or a prefix) to a stored line
+static const char *history_lookup (const History *h, const char *ref) {
+    if (strcmp(ref, "!") == 0) return history_get(h, h->next - 1);
+
+    if (ref[0] == '?') {
+        char q[MAX_LINE];
+        snprintf(q, sizeof(q), "%s", ref + 1);
+        size_t qlen = strlen(q);
+        if (qlen > 0 && q[qlen - 1] == '?') q[--qlen] = '\0';
+        if (qlen == 0) return NULL;
+        return history_get(h, history_search(h, q, h->next));
+    }
+
+    const char *digits = (ref[0] == '-') ? ref + 1 : ref;
+    if (digits[0] != '\0' && strspn(digits, "0123456789") == strlen(digits)) {
+        uint64_t n = strtoull(digits, NULL, 10);
+        if (ref[0] != '-') return history_get(h, n);
+        return (n == 0 || n >= h->next) ? NULL : history_get(h, h->next - n);
+    }
+
+    size_t plen = strlen(ref);
+    for (uint64_t num = h->next; num-- > h->first; ) {
+        const char *line = history_get(h, num);
+        if (strncmp(line, ref, plen) == 0) return line;
+    }
+    return NULL;
+}
+
+// --- HISTORY FILE ---
+/* All sessions append to one history file ($HISTFILE, else ~/.osh_history).
+ * A record is the line followed by a trailer holding its length and a magic
+ * word, written with a single O_APPEND write() so records from concurrent
+ * sessions never interleave. At startup the file is mmap'd and walked
+ * backwards trailer by trailer, so only the last HISTSIZE records are ever
+ * touched no matter how large the file has grown. */
+#define HISTFILE_MAGIC 0x3148534fu	/* "OSH1" */
+#define HISTFILE_RESYNC (64 * 1024)	/* max bytes scanned past a torn record */
+
+typedef struct { uint32_t len, magic; } HistTrailer;
+
+static int histfile_fd = -1;
+
+static void histfile_path (char *path, size_t size) {
+    const char *hf = var_get("HISTFILE");
+    const char *home = var_get("HOME");
+    if (hf != NULL && hf[0] != '\0') snprintf(path, size, "%s", hf);
+    else if (home != NULL) snprintf(path, size, "%s/.osh_history", home);
+    else path[0] = '\0';
+}
+
+// does a valid record end at offset `end`? if so, report where its text starts
+static int histfile_record_at (const char *map, size_t end, size_t *start) {
+    HistTrailer tr;
+    if (end < sizeof(tr)) return 0;
+    memcpy(&tr, map + end - sizeof(tr), sizeof(tr));
+    if (tr.magic != HISTFILE_MAGIC || tr.len > end - sizeof(tr)) return 0;
+    *start = end - sizeof(tr) - tr.len;
+    return 1;
+}
+
+// load the newest records into h and keep the file open for appending
+static void histfile_open (History *h) {
+    char path[4096];
+    histfile_path(path, sizeof(path));
+    if (path[0] == '\0') return;
+
+    histfile_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (histfile_fd < 0) { perror("open(histfile)"); return; }
+
+    struct stat st;
+    if (fstat(histfile_fd, &st) < 0 || st.st_size == 0) return;
+    size_t size = (size_t)st.st_size;
+    char *map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, histfile_fd, 0);
+    if (map == MAP_FAILED) { perror("mmap(histfile)"); return; }
+
+    // walk backwards collecting up to cap records, newest first
+    HistEnt *recs = (HistEnt *)malloc(sizeof(HistEnt) * h->cap);
+    if (!recs) { perror("malloc(histfile)"); exit(1); }
+    size_t n = 0, end = size, skipped = 0;
+    while (n < h->cap && end > 0) {
+        size_t start;
+        if (histfile_record_at(map, end, &start)) {
+            recs[n].off = start;
+            recs[n].len = end - sizeof(HistTrailer) - start;
+            n++;
+            end = start;
+            skipped = 0;
+        } else {
+            // torn or foreign bytes: slide back until a trailer lines up again
+            if (++skipped > HISTFILE_RESYNC) break;
+            end--;
+        }
+    }
+
+    while (n-- > 0) {
+        char *line = strndup(map + recs[n].off, recs[n].len);
+        if (!line) { perror("strndup(histfile)"); exit(1); }
+        history_add(h, line);
+        free(line);
+    }
+    free(recs);
+    munmap(map, size);
+}
+
+static void histfile_append (const char *line) {
+    if (histfile_fd < 0) return;
+    HistTrailer tr = { (uint32_t)strlen(line), HISTFILE_MAGIC };
+    char *rec = malloc(tr.len + sizeof(tr));
+    if (!rec) { perror("malloc(histfile)"); exit(1); }
+    memcpy(rec, line, tr.len);
+    memcpy(rec + tr.len, &tr, sizeof(tr));
+    if (write(histfile_fd, rec, tr.len + sizeof(tr)) < 0) perror("write(histfile)");
+    free(rec);
+}
+
+// --- BUILTINS ---
+typedef int (*builtin_fn)(Cmd *cmd);
+typedef struct { const char *name; builtin_fn fn; } Builtin;
+
+static int bi_stats (Cmd *cmd) {
+    (void)cmd;
+    printf("%-8s %8s %10s %10s %10s %10s   (usec)\n", "", "count", "p50", "p90", "p99", "max");
+    hist_print(&h_parse);
+    hist_print(&h_expand);
+    hist_print(&h_spawn);
+    hist_print(&h_wall);
+    printf("%-8s %8llu   processes saved by pipeline rewrites\n", "saved", (unsigned long long)procs_saved);
+    printf("%-8s %8llu   memo hits (%llu misses)\n", "memo", (unsigned long long)memo_counts->hits, (unsigned long long)memo_counts->misses);
+    return 0;
+}
+
+// "history [n]": list the stored lines, or only the last n
+static int bi_history (Cmd *cmd) {
+    uint64_t from = history.first;
+    if (cmd->argc > 1) {
+        uint64_t n = strtoull(cmd->argv[1], NULL, 10);
+        if (n < history.next - history.first) from = history.next - n;
+    }
+    for (uint64_t num = from; num < history.next; num++) {
+        printf("%5llu  %s\n", (unsigned long long)num, history_get(&history, num));
+    }
+    return 0;
+}
+
+// "export [NAME[=VALUE] ...]": mark variables for the environment, or list them
+static int bi_export (Cmd *cmd) {
+    if (cmd->argc == 1) {
+        for (char **e = vars_envp(); *e; e++) printf("export %s\n", *e);
+        return 0;
+    }
+    int rc = 0;
+    for (int i = 1; i < cmd->argc; i++) {
+        const char *w = cmd->argv[i];
+        size_t len = assignment_len(w);
+        if (len) { var_set(w, len, w + len + 1, 1); continue; }
+        if (!is_name_start((unsigned char)w[0]) || w[strspn(w, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_")] != '\0') {
+            fprintf(stderr, "export: %s: not a valid identifier\n", w);
+            rc = 1;
+            continue;
+        }
+        const char *val = var_get(w);
+        var_set(w, strlen(w), val ? val : "", 1);
+    }
+    return rc;
+}
+
+static int bi_unset (Cmd *cmd) {
+    for (int i = 1; i < cmd->argc; i++) var_unset(cmd->argv[i]);
+    return 0;
+}
+
+/* "read [NAME ...]" takes one line from stdin into NAMEs (REPLY by default),
+ * split on whitespace with the rest of the line going to the last name. A
+ * seekable input is read in blocks and the offset put back after the line,
+ * anything else a byte at a time, so the next reader starts on the next line. */
+static int bi_read (Cmd *cmd) {
+    int seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    Str line = { NULL, 0, 0 };
+    str_putn(&line, "", 0);
+    char blk[4096];
+    int done = 0;
+    while (!done) {
+        ssize_t n = read(STDIN_FILENO, blk, seekable ? sizeof(blk) : 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        char *nl = memchr(blk, '\n', (size_t)n);
+        size_t take = nl ? (size_t)(nl - blk) : (size_t)n;
+        str_putn(&line, blk, take);
+        if (nl == NULL) continue;
+        done = 1;
+        if (seekable && (size_t)n > take + 1) lseek(STDIN_FILENO, -(off_t)((size_t)n - take - 1), SEEK_CUR);
+    }
+
+    const char *p = line.p;
+    int nnames = cmd->argc > 1 ? cmd->argc - 1 : 1;
+    for (int i = 0; i < nnames; i++) {
+        const char *name = cmd->argc > 1 ? cmd->argv[i + 1] : "REPLY";
+        while (*p && is_ifs((unsigned char)*p)) p++;
+        size_t len = 0;
+        if (i + 1 < nnames) {
+            while (p[len] && !is_ifs((unsigned char)p[len])) len++;
+        } else {
+            len = strlen(p);
+            while (len > 0 && is_ifs((unsigned char)p[len - 1])) len--;
+        }
+        char *val = strndup(p, len);
+        if (!val) { perror("strndup(read)"); exit(1); }
+        var_set(name, strlen(name), val, -1);
+        free(val);
+        p += len;
+    }
+    free(line.p);
+    return done ? 0 : 1;
+}
+
+static int bi_fanout (Cmd *cmd);
+static int bi_fanin (Cmd *cmd);
+static int bi_shard (Cmd *cmd);
+static int bi_source (Cmd *cmd);
+static int bi_memo (Cmd *cmd);
+
+static const Builtin builtins[] = {
+    { "stats", bi_stats },
+    { "history", bi_history },
+    { "export", bi_export },
+    { "unset", bi_unset },
+    { "read", bi_read },
+    { "fanout", bi_fanout },
+    { "fanin", bi_fanin },
+    { "shard", bi_shard },
+    { "source", bi_source },
+    { ".", bi_source },
+    { "memo", bi_memo },
+};
+
+static const Builtin *find_builtin (const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+/* "< file" read-ahead: regular files of at least OSH_READAHEAD bytes
+ * (default 1M, K/M/G suffixes allowed, "off" disables) are marked sequential
+ * and their first READAHEAD_WINDOW bytes are queued for reading right away,
+ * so the program starts on a warm page cache instead of faulting in cold. */
+#define READAHEAD_DEFAULT (1L << 20)
+#define READAHEAD_WINDOW (64L << 20)
+
+static void input_hint (int fd) {
+    const char *v = var_get("OSH_READAHEAD");
+    long threshold = READAHEAD_DEFAULT;
+    if (v != NULL) {
+        if (strcmp(v, "off") == 0) return;
+        char *end;
+        long t = strtol(v, &end, 10);
+        int shift = 0;
+        if (*end == 'K' || *end == 'k') shift = 10;
+        else if (*end == 'M' || *end == 'm') shift = 20;
+        else if (*end == 'G' || *end == 'g') shift = 30;
+        // "foo" or "-1" would hint every file, however small: keep the default
+        if (end != v && t >= 0) threshold = t > (LONG_MAX >> shift) ? LONG_MAX : t << shift;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < threshold) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, st.st_size < READAHEAD_WINDOW ? st.st_size : READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+}
+
+// sealed memfd holding data, positioned at its start; -1 on error
+static int here_fd (const char *data) {
+    int fd = memfd_create("osh-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+    size_t len = strlen(data);
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, data + off, len - off);
+        if (n < 0) { if (errno == EINTR) continue; close(fd); return -1; }
+        off += (size_t)n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// --- EXEC ---
+// write end of the spawn status pipe while running in a child, -1 otherwise
+static int status_fd = -1;
+
+// capacity for pipes between stages (OSH_PIPE_SIZE), 0 keeps the kernel default
+static int pipe_size = 0;
+
+// a file without a known binary format is run as a shell script, like execvp
+static void exec_file (const char *file, char **argv, char **envp) {
+    execve(file, argv, envp);
+    if (errno != ENOEXEC) return;
+    int argc = 0;
+    while (argv[argc]) argc++;
+    char **sh_argv = (char **)malloc(sizeof(char *) * (size_t)(argc + 2));
+    if (!sh_argv) return;
+    sh_argv[0] = "/bin/sh";
+    sh_argv[1] = (char *)file;
+    memcpy(sh_argv + 2, argv + 1, sizeof(char *) * (size_t)argc);
+    execve("/bin/sh", sh_argv, envp);
+    free(sh_argv);
+    errno = ENOEXEC;
+}
+
+// execvp, but searching $PATH from our variable table and passing our envp
+static void exec_search (char **argv) {
+    char **envp = vars_envp();
+    if (strchr(argv[0], '/') != NULL) {
+        exec_file(argv[0], argv, envp);
+        return;
+    }
+
+    const char *path = var_get("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    size_t alen = strlen(argv[0]);
+    int denied = 0;
+    char full[PATH_MAX];
+    for (const char *dir = path; ; dir++) {
+        const char *end = strchrnul(dir, ':');
+        size_t dlen = (size_t)(end - dir);
+        if (dlen == 0) { dir = "."; dlen = 1; }	// empty entry is the cwd
+        if (dlen + alen + 2 <= sizeof(full)) {
+            memcpy(full, dir, dlen);
+            full[dlen] = '/';
+            memcpy(full + dlen + 1, argv[0], alen + 1);
+            exec_file(full, argv, envp);
+            if (errno == EACCES) denied = 1;
+            else if (errno != ENOENT && errno != ENOTDIR && errno != ESTALE) return;
+        }
+        if (*end == '\0') break;
+        dir = end;
+    }
+    errno = denied ? EACCES : ENOENT;
+}
+
+/* report errno to the parent through the status pipe and bail out of the
+ * child; children leave with _exit so that exit() cannot flush the shell's
+ * stdio buffers a second time or move the offset of a shared script input */
+static void child_fail (const char *what, Cmd *cmd) {
+    int err = errno;
+    perror(what);
+    if (status_fd >= 0) { ssize_t w = write(status_fd, &err, sizeof(err)); (void)w; }
+    free_cmd(cmd);
+    _exit(1);
+}
+
+static void subst_forget (void);
+
+/* a forked child that goes on running shell code (a builtin stage, a
+ * process substitution) closes what exec would have: otherwise it holds
+ * pipe ends, even of its own input, and the pipelines around it never end */
+static void drop_cloexec_fds (void) {
+    DIR *d = opendir("/proc/self/fd");
+    if (d == NULL) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        int fd = atoi(e->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(d) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) close(fd);
+    }
+    closedir(d);
+    subst_forget();
+}
+
+// bytes one NULL-terminated string vector costs execve against ARG_MAX
+static size_t vec_bytes (char **v) {
+    size_t n = sizeof(char *);
+    for (; *v != NULL; v++) n += strlen(*v) + 1 + sizeof(char *);
+    return n;
+}
+
+// room left for argv once the environment and POSIX's 2048-byte headroom are taken
+static size_t argv_budget (void) {
+    long max = sysconf(_SC_ARG_MAX);
+    if (max <= 0) max = 128 * 1024;
+    size_t used = vec_bytes(vars_envp()) + 2048;
+    return (size_t)max > used ? (size_t)max - used : 0;
+}
+
+static int batch_wait (pid_t pid, int status) {
+    int st;
+    while (waitpid(pid, &st, 0) < 0) {
+        if (errno != EINTR) return status;
+    }
+    int rc = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    return rc > status ? rc : status;
+}
+
+// words kept in every batch; 0 when OSH_ARGMAX_FIXED is unusable or nothing is left to split
+static int batch_fixed (const Cmd *cmd, int *lead, int *trail) {
+    const char *v = var_get("OSH_ARGMAX_FIXED");
+    if (v == NULL) {
+        // the command and its leading options (through "--")
+        int l = 1;
+        while (l < cmd->argc && cmd->argv[l][0] == '-') {
+            if (strcmp(cmd->argv[l++], "--") == 0) break;
+        }
+        *lead = l;
+        *trail = 0;
+        return l < cmd->argc;
+    }
+    char *end;
+    long l = strtol(v, &end, 10), t = 0;
+    if (end == v) return 0;
+    if (*end == ',') {
+        const char *s = end + 1;
+        t = strtol(s, &end, 10);
+        if (end == s) return 0;
+    }
+    if (*end != '\0' || l < 1 || t < 0 || l + t >= cmd->argc) return 0;
+    *lead = (int)l;
+    *trail = (int)t;
+    return 1;
+}
+
+/* An argv that would fail with E2BIG runs xargs-style instead. Every batch
+ * repeats the command and its leading options (through "--"), which suits
+ * "rm -f *.o"; OSH_ARGMAX_FIXED="LEAD[,TRAIL]" names the fixed words when
+ * that is wrong: the first LEAD words ("grep PATTERN") and the last TRAIL
+ * ones ("cp ... DIR"). The words between are packed greedily, which gives the
+ * fewest batches. A word longer than the kernel's per-string limit cannot be
+ * passed at all and still fails with E2BIG. OSH_ARGMAX_JOBS batches may run
+ * at once (default 1, in order); the result is 0 when every batch succeeds,
+ * otherwise the highest batch status. */
+static int exec_batches (Cmd *cmd, size_t budget) {
+    int lead, trail;
+    size_t fixed_bytes = sizeof(char *);
+    int ok = batch_fixed(cmd, &lead, &trail);
+    if (ok) {
+        for (int i = 0; i < lead; i++) fixed_bytes += strlen(cmd->argv[i]) + 1 + sizeof(char *);
+        for (int i = cmd->argc - trail; i < cmd->argc; i++) fixed_bytes += strlen(cmd->argv[i]) + 1 + sizeof(char *);
+    }
+    // MAX_ARG_STRLEN: 32 pages per string
+    size_t strlen_max = (size_t)sysconf(_SC_PAGESIZE) * 32;
+    for (int i = 0; ok && i < cmd->argc; i++) ok = strlen(cmd->argv[i]) < strlen_max;
+    if (!ok || fixed_bytes >= budget) {
+        errno = E2BIG;
+        child_fail(cmd->argv[0], cmd);
+    }
+
+    const char *j = var_get("OSH_ARGMAX_JOBS");
+    long jobs = j ? strtol(j, NULL, 10) : 1;
+    if (jobs < 1) jobs = 1;
+
+    // the shell only waits for the first exec; batches report through their status
+    if (status_fd >= 0) { close(status_fd); status_fd = -1; }
+
+    char **batch = malloc(sizeof(char *) * (size_t)(cmd->argc + 1));
+    pid_t *pids = malloc(sizeof(pid_t) * (size_t)jobs);	// running batches, oldest at pids[first]
+    if (!batch || !pids) { perror("malloc(batch)"); exit(1); }
+    memcpy(batch, cmd->argv, sizeof(char *) * (size_t)lead);
+
+    int status = 0, i = lead, last = cmd->argc - trail;
+    long running = 0, first = 0;
+    while (i < last) {
+        size_t used = fixed_bytes;
+        int n = lead;
+        while (i < last) {
+            size_t cost = strlen(cmd->argv[i]) + 1 + sizeof(char *);
+            if (n > lead && used + cost > budget) break;
+            batch[n++] = cmd->argv[i++];
+            used += cost;
+        }
+        memcpy(batch + n, cmd->argv + last, sizeof(char *) * (size_t)trail);
+        batch[n + trail] = NULL;
+
+        if (running == jobs) {
+            status = batch_wait(pids[first], status);
+            first = (first + 1) % jobs;
+            running--;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork(batch)"); if (status == 0) status = 1; break; }
+        if (pid == 0) {
+            exec_search(batch);
+            child_fail(batch[0], cmd);
+        }
+        pids[(first + running) % jobs] = pid;
+        running++;
+    }
+    for (; running > 0; running--) {
+        status = batch_wait(pids[first], status);
+        first = (first + 1) % jobs;
+    }
+
+    free(pids);
+    free(batch);
+    free_cmd(cmd);
+    return status;
+}
+
+// run one expanded pipeline stage in a forked child; never returns
+static void exec_stage (Cmd *cmd) {
+    // "NAME=VALUE cmd": assignments only go into this command's environment
+    int nassign = 0;
+    while (nassign < cmd->argc - 1 && assignment_len(cmd->argv[nassign])) {
+        char *w = cmd->argv[nassign];
+        size_t len = assignment_len(w);
+        var_set(w, len, w + len + 1, 1);
+        free(w);
+        nassign++;
+    }
+    if (nassign > 0) {
+        memmove(cmd->argv, cmd->argv + nassign, sizeof(char *) * (size_t)(cmd->argc - nassign + 1));
+        cmd->argc -= nassign;
+    }
+
+    // builtins used as a pipeline stage run in this child instead of exec'ing
+    const Builtin *b = find_builtin(cmd->argv[0]);
+    if (b != NULL) {
+        if (status_fd >= 0) close(status_fd);
+        drop_cloexec_fds();
+        int rc = b->fn(cmd);
+        fflush(stdout);
+        free_cmd(cmd);
+        _exit(rc);
+    }
+
+    // argument lists past ARG_MAX are split into batches instead of failing with E2BIG
+    size_t budget = argv_budget();
+    if (vec_bytes(cmd->argv) > budget) _exit(exec_batches(cmd, budget));
+    
+    exec_search(cmd->argv);
+    
+    // if execve doesn't replace the current (child) process image with the new program, throw an error
+    child_fail(cmd->argv[0], cmd);
+}
+
+// --- BYTECODE ---
+/* A parsed command line is lowered into a flat instruction stream before it
+ * runs. Descriptors live in numbered registers: PIPE and OPEN fill them, DUP
+ * queues one to become a standard descriptor of the next SPAWN (which then
+ * owns and closes it), SPAWN expands and starts one stage, and WAIT or BG ends
+ * the pipeline. Words stay unexpanded in the program's pool and are expanded
+ * each time the program runs, so a compiled script (see bi_source) is run
+ * again without being re-lexed or re-parsed. */
+typedef enum {
+    OP_PIPE,	// a: register pair, read end a and write end a + 1
+    OP_OPEN,	// a: register, b: word, c: R_IN, R_OUT, R_HERE or R_CAT
+    OP_DUP,	// a: register, b: descriptor it becomes in the next stage
+    OP_SPAWN,	// a: first word, b: word count, c: SPAWN_* flags
+    OP_WAIT,	// wait for the pipeline and set $?; a: 1 when a dropped "cat" ended it
+    OP_BG,	// leave the pipeline running
+    OP_NOP,
+    OP_JMP,	// a: target
+    OP_JFALSE,	// a: target taken when $? is not 0
+    OP_JTRUE,	// a: target taken when $? is 0
+    OP_STATUS,	// a: value for $?
+    OP_PUSHFD,	// a: register moved onto descriptor b (a keeps the old one), c: target on failure
+    OP_POPFD,	// a: register restored onto descriptor b
+    OP_FORINIT,	// a: slot, b: first word, c: word count; expands the list once
+    OP_FORNEXT,	// a: slot, b: variable name, c: target once the list is used up
+    OP_CASEWORD,	// a: slot, b: word; expands the subject once
+    OP_MATCH,	// a: slot, b: pattern word, c: target when it matches
+    OP_JTTY,	// a: target taken when the shell's stdout is a terminal
+    OP_SAVED,	// a: processes the peephole pass took out (for stats)
+} OpCode;
+
+#define SPAWN_SOLO 1	// the whole pipeline: builtins and assignments stay in the shell
+#define SPAWN_LAST 2	// the pipeline's last stage: fanout runs in the shell
+
+typedef struct {
+    uint8_t op;
+    int a, b, c;
+} Insn;
+
+struct Program {
+    Insn *code;
+    size_t len, cap;
+    char **words;
+    size_t nwords, wcap;
+    int nregs;
+    int nslots;	// for and case state
+};
+
+static void prog_init (Program *p) {
+    memset(p, 0, sizeof(*p));
+}
+
+static void prog_free (Program *p) {
+    for (size_t i = 0; i < p->nwords; i++) free(p->words[i]);
+    free(p->words);
+    free(p->code);
+    prog_init(p);
+}
+
+static void prog_emit (Program *p, OpCode op, int a, int b, int c) {
+    if (p->len == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 16;
+        p->code = (Insn *)realloc(p->code, sizeof(Insn) * p->cap);
+        if (!p->code) { perror("realloc(code)"); exit(1); }
+    }
+    p->code[p->len++] = (Insn){ (uint8_t)op, a, b, c };
+}
+
+static int prog_word (Program *p, const char *word) {
+    if (p->nwords == p->wcap) {
+        p->wcap = p->wcap ? p->wcap * 2 : 16;
+        p->words = (char **)realloc(p->words, sizeof(char *) * p->wcap);
+        if (!p->words) { perror("realloc(words)"); exit(1); }
+    }
+    p->words[p->nwords] = strdup(word);
+    if (!p->words[p->nwords]) { perror("strdup(word)"); exit(1); }
+    return (int)p->nwords++;
+}
+
+static void compile_open (Program *p, const char *word, RedirKind kind, int target) {
+    int r = p->nregs++;
+    prog_emit(p, OP_OPEN, r, prog_word(p, word), kind);
+    prog_emit(p, OP_DUP, r, target, 0);
+}
+
+// jumps to a label not placed yet are chained through their target operand
+static void patch_chain (Program *p, int chain, size_t target) {
+    while (chain >= 0) {
+        int next = p->code[chain].a;
+        p->code[chain].a = (int)target;
+        chain = next;
+    }
+}
+
+static int emit_chained (Program *p, OpCode op, int chain) {
+    prog_emit(p, op, chain, 0, 0);
+    return (int)p->len - 1;
+}
+
+// one pipeline stage as it will be emitted: the peephole pass moves redirects between stages
+typedef struct {
+    const Cmd *cmd;
+    const char *in_path, *in_data, *out_path;
+    int in_cat;	// in_path came from a cat the peephole pass removed
+} Stage;
+
+static int explain = 0;	// "osh --explain": print rewritten pipeline plans
+static int rewrite = 1;	// "osh --no-rewrite" runs every pipeline as written
+
+static int peephole (Stage *st, size_t *n, int *cat_last);
+static void explain_plan (const Stage *orig, size_t n, const Stage *st, size_t m, int tail);
+
+// last: flags for the final stage (SPAWN_LAST unless the pipeline runs in the background)
+static void compile_stages (Program *p, const Stage *st, size_t n, int solo, int last) {
+    int prev = -1;	// read end of the pipe from the previous stage
+    for (size_t i = 0; i < n; i++) {
+        int pipe_reg = -1;
+        if (i + 1 < n) {
+            pipe_reg = p->nregs;
+            p->nregs += 2;
+            prog_emit(p, OP_PIPE, pipe_reg, 0, 0);
+        }
+        if (prev >= 0) prog_emit(p, OP_DUP, prev, STDIN_FILENO, 0);
+        if (st[i].in_path) compile_open(p, st[i].in_path, st[i].in_cat ? R_CAT : R_IN, STDIN_FILENO);
+        if (st[i].in_data) compile_open(p, st[i].in_data, R_HERE, STDIN_FILENO);
+        if (pipe_reg >= 0) prog_emit(p, OP_DUP, pipe_reg + 1, STDOUT_FILENO, 0);
+        if (st[i].out_path) compile_open(p, st[i].out_path, R_OUT, STDOUT_FILENO);
+
+        int first = (int)p->nwords;
+        for (int w = 0; w < st[i].cmd->argc; w++) prog_word(p, st[i].cmd->argv[w]);
+        prog_emit(p, OP_SPAWN, first, st[i].cmd->argc, (solo ? SPAWN_SOLO : 0) | (i + 1 == n ? last : 0));
+        prev = pipe_reg;
+    }
+}
+
+/* lower one parsed pipeline (stages linked right to left) into p. When the
+ * peephole pass can only drop a trailing "| cat" while stdout is not a
+ * terminal, both versions are emitted behind a JTTY test. */
+static void compile_pipeline (Program *p, const Cmd *head) {
+    size_t n = 0;
+    for (const Cmd *c = head; c; c = c->pipe_cmd) n++;
+    Stage *orig = malloc(sizeof(Stage) * n * 2);
+    if (!orig) { perror("malloc(stages)"); exit(1); }
+    size_t i = n;
+    for (const Cmd *c = head; c; c = c->pipe_cmd) {
+        orig[--i] = (Stage){ c, c->redir_in_path, c->redir_in_data, c->redir_out_path, 0 };
+    }
+
+    Stage *st = orig + n;
+    memcpy(st, orig, sizeof(Stage) * n);
+    size_t m = n;
+    int tail = 0, cat_last = 0;
+    if (rewrite) tail = peephole(st, &m, &cat_last);
+    if (explain && (m < n || tail)) explain_plan(orig, n, st, m, tail);
+
+    // a pipeline ending in cat has cat's status, not that of the stage before it
+    int end = head->is_background ? OP_BG : OP_WAIT;
+    int fg = head->is_background ? 0 : SPAWN_LAST;
+    int to_full = -1, to_end = -1;
+    if (tail) {
+        to_full = emit_chained(p, OP_JTTY, -1);
+        prog_emit(p, OP_SAVED, (int)(n - m) + 1, 0, 0);
+        compile_stages(p, st, m - 1, 0, fg);
+        prog_emit(p, end, 1, 0, 0);
+        to_end = emit_chained(p, OP_JMP, -1);
+        patch_chain(p, to_full, p->len);
+    }
+    if (m < n) prog_emit(p, OP_SAVED, (int)(n - m), 0, 0);
+    compile_stages(p, st, m, n == 1, fg);
+    prog_emit(p, end, cat_last, 0, 0);
+    patch_chain(p, to_end, p->len);
+    free(orig);
+}
+
+// --- PEEPHOLE ---
+/* Rewrites that take processes out of a pipeline without changing what it
+ * produces or its status, applied until none matches:
+ *   cat FILE | cmd   ->  cmd < FILE    (also "cat < FILE" and "cat <<END")
+ *   a | cat | b      ->  a | b
+ *   a | cat > FILE   ->  a > FILE
+ *   a | cat          ->  a             (decided when it runs: only while
+ *                                       stdout is not a terminal, since
+ *                                       programs format for ttys)
+ * Only a bare "cat" qualifies, and FILE must be a literal word. A FILE that
+ * cannot be read (R_CAT) gets cat's error and leaves cmd an empty input, as
+ * the pipe from cat would have. When the last stage was a cat, $? is 0 as cat's would be, unless a redirect of the
+ * new last stage fails. "osh --explain" prints every plan that changes,
+ * "osh --no-rewrite" turns the pass off; "stats" counts the processes saved. */
+
+static int is_bare_cat (const Stage *s) {
+    return s->cmd->argc == 1 && strcmp(s->cmd->argv[0], "cat") == 0 && s->out_path == NULL;
+}
+
+static void stage_drop (Stage *st, size_t *n, size_t i) {
+    memmove(st + i, st + i + 1, sizeof(Stage) * (*n - i - 1));
+    (*n)--;
+}
+
+/* returns 1 when a trailing "| cat" is left for the runtime tty check;
+ * *cat_last is set when "| cat > FILE" was folded into the stage before it */
+static int peephole (Stage *st, size_t *n, int *cat_last) {
+    for (int changed = 1; changed && *n > 1; ) {
+        changed = 0;
+
+        // cat FILE | cmd, cat < FILE | cmd
+        const Cmd *c = st[0].cmd;
+        int cat_file = c->argc == 2 && strcmp(c->argv[0], "cat") == 0 && c->argv[1][0] != '-' && !needs_expansion(c->argv[1]) && !is_procsub(c->argv[1]) && !st[0].in_path && !st[0].in_data && !st[0].out_path;
+        if (cat_file || (is_bare_cat(&st[0]) && (st[0].in_path || st[0].in_data))) {
+            st[1].in_path = cat_file ? c->argv[1] : st[0].in_path;
+            st[1].in_cat = st[1].in_path != NULL;
+            st[1].in_data = cat_file ? NULL : st[0].in_data;
+            stage_drop(st, n, 0);
+            changed = 1;
+            continue;
+        }
+
+        // a | cat | b
+        for (size_t i = 1; i + 1 < *n; i++) {
+            if (is_bare_cat(&st[i]) && !st[i].in_path && !st[i].in_data) { stage_drop(st, n, i); changed = 1; break; }
+        }
+        if (changed) continue;
+
+        // a | cat > FILE (a device could be a terminal)
+        const Stage *last = &st[*n - 1];
+        if (last->cmd->argc == 1 && strcmp(last->cmd->argv[0], "cat") == 0 && last->out_path && !last->in_path && !last->in_data && strncmp(last->out_path, "/dev/", 5) != 0) {
+            st[*n - 2].out_path = last->out_path;
+            stage_drop(st, n, *n - 1);
+            *cat_last = 1;
+            changed = 1;
+        }
+    }
+    return *n > 1 && is_bare_cat(&st[*n - 1]) && !st[*n - 1].in_path && !st[*n - 1].in_data;
+}
+
+static void plan_print (const Stage *st, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0) fputs(" |", stderr);
+        for (int w = 0; w < st[i].cmd->argc; w++) fprintf(stderr, "%s%s", i + w ? " " : "", st[i].cmd->argv[w]);
+        if (st[i].in_path) fprintf(stderr, " < %s", st[i].in_path);
+        if (st[i].in_data) fputs(" << (here-document)", stderr);
+        if (st[i].out_path) fprintf(stderr, " > %s", st[i].out_path);
+    }
+}
+
+static void explain_plan (const Stage *orig, size_t n, const Stage *st, size_t m, int tail) {
+    fputs("explain: ", stderr);
+    plan_print(orig, n);
+    fputs("\n     ->  ", stderr);
+    plan_print(st, tail ? m - 1 : m);
+    size_t saved = n - m + (size_t)tail;
+    fprintf(stderr, "   (%zu process%s saved", saved, saved == 1 ? "" : "es");
+    if (tail) fputs("; \"| cat\" kept while stdout is a terminal", stderr);
+    fputs(")\n", stderr);
+}
+
+// --- VM ---
+
+typedef struct { int reg, target; } PendingDup;
+
+typedef struct {
+    Cmd list;	// for: expanded words
+    int next;
+    char *subject;	// case: expanded word
+} VmSlot;
+
+static int vm_depth = 0;	// programs running inside builtins and "$(...)" nest
+static int memo_input = 0;	// the stage's stdin is a pipe or a redirect, not the shell's own
+
+typedef struct {
+    int *fds;	// registers, -1 when empty
+    PendingDup *dups;	// queued for the next SPAWN
+    int ndups, dcap;
+    pid_t *pids;	// stages started for the current pipeline
+    size_t npids, pcap;
+    int last_forked;	// the latest stage is pids[npids - 1]
+    int stage_status;	// otherwise, its status
+    uint64_t t_start;
+    VmSlot *slots;
+} VmState;
+
+// the spawned stage owns its queued descriptors: the shell closes its copies
+static void vm_release (VmState *vm) {
+    for (int i = 0; i < vm->ndups; i++) {
+        int *fd = &vm->fds[vm->dups[i].reg];
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+    }
+    vm->ndups = 0;
+}
+
+// run a builtin in the shell itself with the queued descriptors swapped in
+static int vm_builtin (VmState *vm, const Builtin *b, Cmd *cmd) {
+    int *saved = malloc(sizeof(int) * (size_t)(vm->ndups + 1));
+    if (!saved) { perror("malloc(builtin)"); exit(1); }
+    fflush(stdout);
+    for (int i = 0; i < vm->ndups; i++) {
+        saved[i] = fcntl(vm->dups[i].target, F_DUPFD_CLOEXEC, 10);
+        if (dup2(vm->fds[vm->dups[i].reg], vm->dups[i].target) < 0) perror("dup2(builtin)");
+    }
+    int rc = b->fn(cmd);
+    fflush(stdout);
+    for (int i = vm->ndups - 1; i >= 0; i--) {
+        if (saved[i] < 0) { close(vm->dups[i].target); continue; }
+        dup2(saved[i], vm->dups[i].target);
+        close(saved[i]);
+    }
+    free(saved);
+    return rc;
+}
+
+static void vm_spawn (VmState *vm, const Program *p, const Insn *in) {
+    Cmd stage; cmd_init(&stage);
+    for (int i = 0; i < in->b; i++) {
+        char *w = strdup(p->words[in->a + i]);
+        if (!w) { perror("strdup(word)"); exit(1); }
+        cmd_push_arg(&stage, w);
+    }
+    uint64_t t_expand = now_ns();
+    expand_cmd(&stage);
+    hist_record(&h_expand, now_ns() - t_expand);
+
+    vm->last_forked = 0;
+    vm->stage_status = 1;
+    for (int i = 0; i < vm->ndups; i++) {
+        if (vm->fds[vm->dups[i].reg] < 0) goto done;	// its redirect failed
+    }
+    memo_input = 0;
+    for (int i = 0; i < vm->ndups; i++) memo_input |= vm->dups[i].target == STDIN_FILENO;
+    if (stage.argc == 0) { vm->stage_status = 0; goto done; }
+
+    if (in->c & SPAWN_SOLO) {
+        // "NAME=VALUE ..." on its own sets shell variables
+        int all = 1;
+        for (int i = 0; i < stage.argc && all; i++) all = assignment_len(stage.argv[i]) > 0;
+        if (all) {
+            for (int i = 0; i < stage.argc; i++) {
+                size_t len = assignment_len(stage.argv[i]);
+                var_set(stage.argv[i], len, stage.argv[i] + len + 1, -1);
+            }
+            vm->stage_status = 0;
+            goto done;
+        }
+        const Builtin *b = find_builtin(stage.argv[0]);
+        if (b != NULL) { vm->stage_status = vm_builtin(vm, b, &stage); goto done; }
+    }
+
+    // "... | fanout ...": the tee/splice loop needs no process of its own, and
+    // nothing after it in the pipeline waits to be started
+    if ((in->c & SPAWN_LAST) && strcmp(stage.argv[0], "fanout") == 0) {
+        vm->stage_status = vm_builtin(vm, find_builtin("fanout"), &stage);
+        goto done;
+    }
+
+    // status pipe: closed by exec (CLOEXEC) on success, carries errno on failure
+    int sp[2];
+    if (pipe2(sp, O_CLOEXEC) == -1) { perror("pipe2(status)"); goto done; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork()"); close(sp[READ_END]); close(sp[WRITE_END]); goto done; }
+    if (pid == 0) {
+        // child
+        close(sp[READ_END]);
+        status_fd = sp[WRITE_END];
+        for (int i = 0; i < vm->ndups; i++) {
+            if (dup2(vm->fds[vm->dups[i].reg], vm->dups[i].target) < 0) child_fail("dup2", &stage);
+        }
+        for (int r = 0; r < p->nregs; r++) if (vm->fds[r] >= 0) close(vm->fds[r]);
+        exec_stage(&stage);
+    }
+
+    // parent
+    uint64_t t_fork = now_ns();
+    close(sp[WRITE_END]);
+    int err = 0;
+    ssize_t n;
+    do { n = read(sp[READ_END], &err, sizeof(err)); } while (n < 0 && errno == EINTR);
+    close(sp[READ_END]);
+    if (n == 0) hist_record(&h_spawn, now_ns() - t_fork);
+
+    if (vm->npids == vm->pcap) {
+        vm->pcap = vm->pcap ? vm->pcap * 2 : 8;
+        vm->pids = (pid_t *)realloc(vm->pids, sizeof(pid_t) * vm->pcap);
+        if (!vm->pids) { perror("realloc(pids)"); exit(1); }
+    }
+    vm->pids[vm->npids++] = pid;
+    vm->last_forked = 1;
+done:
+    vm_release(vm);
+    free_cmd(&stage);
+}
+
+// execute a compiled program; $? is left in last_status
+static void vm_run (const Program *p) {
+    VmState vm;
+    memset(&vm, 0, sizeof(vm));
+    vm.fds = malloc(sizeof(int) * (size_t)(p->nregs + 1));
+    if (!vm.fds) { perror("malloc(fds)"); exit(1); }
+    for (int r = 0; r < p->nregs; r++) vm.fds[r] = -1;
+    vm.slots = calloc((size_t)p->nslots + 1, sizeof(VmSlot));
+    if (!vm.slots) { perror("calloc(slots)"); exit(1); }
+    vm_depth++;
+
+    for (size_t pc = 0; pc < p->len; ) {
+        const Insn *in = &p->code[pc++];
+        if (vm.t_start == 0) vm.t_start = now_ns();
+        switch ((OpCode)in->op) {
+        case OP_PIPE: {
+            int fd[2];
+            if (pipe2(fd, O_CLOEXEC) == -1) { perror("pipe"); break; }
+            if (pipe_size > 0 && fcntl(fd[WRITE_END], F_SETPIPE_SZ, pipe_size) < 0) perror("fcntl(F_SETPIPE_SZ)");
+            vm.fds[in->a] = fd[READ_END];
+            vm.fds[in->a + 1] = fd[WRITE_END];
+            break;
+        }
+        case OP_OPEN: {
+            char *w = strdup(p->words[in->b]);
+            if (!w) { perror("strdup(word)"); exit(1); }
+            expand_path(&w);
+            int fd;
+            if (in->c == R_HERE) fd = here_fd(w);
+            else if (in->c == R_IN || in->c == R_CAT) fd = open(w, O_RDONLY | O_CLOEXEC);
+            else fd = open(w, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (in->c == R_CAT) {
+                // what cat could not read (missing, a directory) leaves the next stage an empty input
+                struct stat st;
+                if (fd >= 0 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) { close(fd); fd = -1; errno = EISDIR; }
+                if (fd < 0) {
+                    fprintf(stderr, "cat: %s: %s\n", w, strerror(errno));
+                    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                }
+            }
+            if (fd < 0) perror(in->c == R_HERE ? "memfd_create(here)" : w);
+            else if (in->c == R_IN || in->c == R_CAT) input_hint(fd);
+            vm.fds[in->a] = fd;
+            free(w);
+            break;
+        }
+        case OP_DUP:
+            if (vm.ndups == vm.dcap) {
+                vm.dcap = vm.dcap ? vm.dcap * 2 : 4;
+                vm.dups = (PendingDup *)realloc(vm.dups, sizeof(PendingDup) * (size_t)vm.dcap);
+                if (!vm.dups) { perror("realloc(dups)"); exit(1); }
+            }
+            vm.dups[vm.ndups++] = (PendingDup){ in->a, in->b };
+            break;
+        case OP_SPAWN:
+            vm_spawn(&vm, p, in);
+            break;
+        case OP_WAIT: {
+            int status = 0;
+            for (size_t i = 0; i < vm.npids; i++) {
+                while (waitpid(vm.pids[i], &status, 0) < 0 && errno == EINTR) { /* retry */ }
+            }
+            if (vm.npids > 0) hist_record(&h_wall, now_ns() - vm.t_start);
+            if (!vm.last_forked) last_status = vm.stage_status;
+            else if (in->a) last_status = 0;	// the cat that was dropped would have succeeded
+            else last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            goto next_pipeline;
+        }
+        case OP_BG:
+            last_status = 0;
+        next_pipeline:
+            vm.npids = 0;
+            vm.t_start = 0;
+            // reap finished background jobs (no zombies); a nested program
+            // could take a stage its caller is about to wait for
+            if (vm_depth == 1) while (waitpid(-1, NULL, WNOHANG) > 0) { /* reaped one child */ }
+            break;
+        case OP_NOP:
+            break;
+        case OP_JTTY:
+            if (isatty(STDOUT_FILENO)) pc = (size_t)in->a;
+            break;
+        case OP_SAVED:
+            procs_saved += (uint64_t)in->a;
+            break;
+        case OP_JMP:
+            pc = (size_t)in->a;
+            break;
+        case OP_JFALSE:
+            if (last_status != 0) pc = (size_t)in->a;
+            break;
+        case OP_JTRUE:
+            if (last_status == 0) pc = (size_t)in->a;
+            break;
+        case OP_STATUS:
+            last_status = in->a;
+            break;
+        case OP_PUSHFD: {
+            int fd = vm.fds[in->a];
+            if (fd < 0) { last_status = 1; pc = (size_t)in->c; break; }
+            fflush(stdout);
+            vm.fds[in->a] = fcntl(in->b, F_DUPFD_CLOEXEC, 10);
+            if (dup2(fd, in->b) < 0) perror("dup2(redirect)");
+            close(fd);
+            break;
+        }
+        case OP_POPFD:
+            fflush(stdout);
+            if (vm.fds[in->a] < 0) { close(in->b); break; }
+            dup2(vm.fds[in->a], in->b);
+            close(vm.fds[in->a]);
+            vm.fds[in->a] = -1;
+            break;
+        case OP_FORINIT: {
+            VmSlot *sl = &vm.slots[in->a];
+            if (sl->list.argv) free_cmd(&sl->list);
+            cmd_init(&sl->list);
+            for (int i = 0; i < in->c; i++) {
+                char *w = strdup(p->words[in->b + i]);
+                if (!w) { perror("strdup(word)"); exit(1); }
+                cmd_push_arg(&sl->list, w);
+            }
+            expand_cmd(&sl->list);
+            sl->next = 0;
+            break;
+        }
+        case OP_FORNEXT: {
+            VmSlot *sl = &vm.slots[in->a];
+            if (sl->next >= sl->list.argc) { pc = (size_t)in->c; break; }
+            const char *name = p->words[in->b];
+            var_set(name, strlen(name), sl->list.argv[sl->next++], -1);
+            break;
+        }
+        case OP_CASEWORD:
+            free(vm.slots[in->a].subject);
+            vm.slots[in->a].subject = expand_string(p->words[in->b]);
+            break;
+        case OP_MATCH: {
+            char *pat = expand_string(p->words[in->b]);
+            GlobPat g;
+            glob_compile(&g, pat);
+            g.dot_ok = 1;
+            if (glob_match(&g, vm.slots[in->a].subject)) pc = (size_t)in->c;
+            glob_free(&g);
+            free(pat);
+            break;
+        }
+        }
+    }
+
+    for (int i = 0; i < p->nslots; i++) {
+        if (vm.slots[i].list.argv) free_cmd(&vm.slots[i].list);
+        free(vm.slots[i].subject);
+    }
+    free(vm.slots);
+    vm_depth--;
+    for (int r = 0; r < p->nregs; r++) if (vm.fds[r] >= 0) close(vm.fds[r]);
+    free(vm.fds);
+    free(vm.pids);
+    free(vm.dups);
+}
+
+// --- COMMAND SUBSTITUTION ---
+/* "$(...)" is parsed, compiled and run by the VM inside the shell with stdout
+ * pointed at a reused memfd (one per nesting level), so a lone builtin costs
+ * no fork at all and a pipeline forks only its own stages. The output is read
+ * back once everything has finished; trailing newlines are dropped and $?
+ * becomes the inner command's status. */
+#define SUBST_DEPTH 16
+
+static int subst_memfd[SUBST_DEPTH] = { [0 ... SUBST_DEPTH - 1] = -1 };
+static int subst_depth = 0;
+
+// the memfds were closed in a child that dropped its CLOEXEC descriptors
+static void subst_forget (void) {
+    for (int i = 0; i < SUBST_DEPTH; i++) subst_memfd[i] = -1;
+}
+
+static void subst_read (int fd, Str *out) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return;
+    for (off_t off = 0; off < st.st_size; ) {
+        size_t want = (size_t)(st.st_size - off);
+        str_putn(out, "", 0);
+        if (out->len + want + 1 > out->cap) {
+            while (out->len + want + 1 > out->cap) out->cap *= 2;
+            out->p = (char *)realloc(out->p, out->cap);
+            if (!out->p) { perror("realloc(subst)"); exit(1); }
+        }
+        ssize_t n = pread(fd, out->p + out->len, want, off);
+        if (n <= 0) break;
+        out->len += (size_t)n;
+        off += n;
+    }
+}
+
+static void subst_run (const Program *prog, Str *out) {
+    if (subst_depth == SUBST_DEPTH) { fputs("$(...): nested too deeply\n", stderr); last_status = 1; return; }
+    int *mfd = &subst_memfd[subst_depth];
+    if (*mfd < 0) {
+        *mfd = memfd_create("osh-subst", MFD_CLOEXEC);
+        if (*mfd < 0) { perror("memfd_create"); last_status = 1; return; }
+    }
+    if (ftruncate(*mfd, 0) < 0 || lseek(*mfd, 0, SEEK_SET) < 0) { perror("ftruncate(subst)"); last_status = 1; return; }
+
+    fflush(stdout);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (saved_out < 0 || dup2(*mfd, STDOUT_FILENO) < 0) { perror("dup2(subst)"); last_status = 1; return; }
+    subst_depth++;
+    vm_run(prog);
+    subst_depth--;
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+    subst_read(*mfd, out);
+}
+
+static void command_subst (const char *src, size_t len, Str *out) {
+    str_putn(out, "", 0);
+    char *line = strndup(src, len);
+    if (!line) { perror("strndup(subst)"); exit(1); }
+
+    Program prog; prog_init(&prog);
+    if (compile_line(&prog, line) < 0) last_status = 2;
+    else subst_run(&prog, out);
+    prog_free(&prog);
+    free(line);
+
+    while (out->len > 0 && out->p[out->len - 1] == '\n') out->len--;
+    out->p[out->len] = '\0';
+}
+
+// --- FAN-OUT ---
+/* "fanout [-a] target ..." copies its input to stdout and to every target
+ * without a user-space copy: a target is a file, or ">(pipeline)" which is
+ * started with its stdin on a pipe. Each round tee(2)s whatever the input
+ * pipe holds into one empty staging pipe per sink (the last one splice(2)s,
+ * consuming it), then splices every staging pipe out to its sink. As the
+ * last stage of a pipeline it runs in the shell itself; anywhere else it is a
+ * forked stage like any builtin, since the stages after it must run. Staging
+ * pipes match the input's capacity, so a tee should not come up short; if
+ * one does, the round copies only what every sink got and the extra bytes
+ * staged for earlier sinks are thrown away, to be tee'd again next round. */
+#define FANOUT_MAX 16
+#define FANOUT_CHUNK (64 * 1024)	// copy size for sinks that refuse splice
+
+typedef struct {
+    int fd;	// sink
+    int stage[2];	// staging pipe
+    int spliceable;	// cleared when the sink refuses splice (e.g. a tty)
+} FanSink;
+
+static int write_all (int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// drain a staging pipe into its sink; -1 when the sink is gone
+static int fanout_drain (FanSink *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = -1;
+        if (s->spliceable) {
+            w = splice(s->stage[READ_END], NULL, s->fd, NULL, n, SPLICE_F_MOVE);
+            if (w < 0 && errno == EINVAL) s->spliceable = 0;
+        }
+        if (!s->spliceable) {
+            char buf[FANOUT_CHUNK];
+            w = read(s->stage[READ_END], buf, n < sizeof(buf) ? n : sizeof(buf));
+            if (w <= 0 || write_all(s->fd, buf, (size_t)w) < 0) return -1;
+        }
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+// drop n bytes a staging pipe got beyond what the round copies
+static void fanout_discard (FanSink *s, size_t n) {
+    char buf[FANOUT_CHUNK];
+    while (n > 0) {
+        ssize_t r = read(s->stage[READ_END], buf, n < sizeof(buf) ? n : sizeof(buf));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return;
+        n -= (size_t)r;
+    }
+}
+
+/* start ">(pipeline)" reading from a new pipe, or "<(pipeline)" writing to
+ * one; returns the shell's end of that pipe */
+static int procsub_spawn (const char *who, const char *word, pid_t *pid) {
+    size_t len = strlen(word);
+    if (len < 3 || word[len - 1] != ')') { fprintf(stderr, "%s: %s: unterminated\n", who, word); return -1; }
+    char *line = strndup(word + 2, len - 3);
+    if (!line) { perror("strndup(procsub)"); exit(1); }
+    int child_end = (word[0] == '>') ? READ_END : WRITE_END;
+    int child_fd = (word[0] == '>') ? STDIN_FILENO : STDOUT_FILENO;
+
+    Program prog; prog_init(&prog);
+    int fd[2] = { -1, -1 };
+    if (compile_line(&prog, line) < 0) {
+        fprintf(stderr, "%s: %s: syntax error\n", who, word);
+    } else if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("pipe(procsub)");
+    } else {
+        fflush(stdout);
+        *pid = fork();
+        if (*pid == 0) {
+            if (dup2(fd[child_end], child_fd) < 0) { perror("dup2(procsub)"); _exit(1); }
+            drop_cloexec_fds();
+            vm_run(&prog);
+            fflush(stdout);
+            _exit(last_status);
+        }
+        close(fd[child_end]);
+        if (*pid < 0) { perror("fork(procsub)"); close(fd[!child_end]); fd[!child_end] = -1; }
+    }
+    prog_free(&prog);
+    free(line);
+    return fd[!child_end];
+}
+
+static int bi_fanout (Cmd *cmd) {
+    int append = (cmd->argc > 1 && strcmp(cmd->argv[1], "-a") == 0);
+    int first = 1 + append;
+    if (cmd->argc - first + 1 > FANOUT_MAX) { fprintf(stderr, "fanout: at most %d targets\n", FANOUT_MAX - 1); return 1; }
+
+    // the input must be a pipe for tee(2); anything else is spliced into one
+    int src = STDIN_FILENO, feed[2] = { -1, -1 };
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+        if (pipe2(feed, O_CLOEXEC) < 0) { perror("pipe(fanout)"); return 1; }
+        src = feed[READ_END];
+    }
+    int cap = fcntl(src, F_GETPIPE_SZ);
+
+    FanSink sinks[FANOUT_MAX];
+    pid_t pids[FANOUT_MAX];
+    int nsinks = 0, npids = 0, rc = 0;
+    sinks[nsinks++].fd = STDOUT_FILENO;
+    for (int i = first; i < cmd->argc; i++) {
+        int fd;
+        if (is_procsub(cmd->argv[i])) {
+            fd = (cmd->argv[i][0] == '>') ? procsub_spawn("fanout", cmd->argv[i], &pids[npids]) : -1;
+            if (fd < 0 && cmd->argv[i][0] == '<') fprintf(stderr, "fanout: %s: not an output\n", cmd->argv[i]);
+            if (fd >= 0) npids++;
+        } else {
+            fd = open(cmd->argv[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+            if (fd < 0) perror(cmd->argv[i]);
+        }
+        if (fd < 0) { rc = 1; continue; }
+        sinks[nsinks++].fd = fd;
+    }
+    for (int i = 0; i < nsinks; i++) {
+        if (pipe2(sinks[i].stage, O_CLOEXEC) < 0) { perror("pipe(fanout)"); exit(1); }
+        if (cap > 0) fcntl(sinks[i].stage[WRITE_END], F_SETPIPE_SZ, cap);
+        sinks[i].spliceable = 1;
+    }
+
+    // a sink that goes away is dropped instead of killing the copy
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+    for (int live = nsinks; live > 0; ) {
+        if (feed[WRITE_END] >= 0) {
+            ssize_t f = splice(STDIN_FILENO, NULL, feed[WRITE_END], NULL, (size_t)(cap > 0 ? cap : 65536), 0);
+            if (f < 0 && errno == EINTR) continue;
+            if (f < 0) { perror("splice(fanout)"); rc = 1; break; }
+            // what a short round left in the feed still goes out; then the tees see its end
+            if (f == 0) { close(feed[WRITE_END]); feed[WRITE_END] = -1; }
+        }
+
+        ssize_t n = 0, got[FANOUT_MAX];
+        int last = -1;
+        for (int i = 0; i < nsinks; i++) if (sinks[i].fd >= 0) last = i;
+        for (int i = 0; i < nsinks; i++) {
+            if (sinks[i].fd < 0) continue;
+            size_t want = n > 0 ? (size_t)n : (size_t)INT_MAX;
+            ssize_t k;
+            do {
+                k = (i == last) ? splice(src, NULL, sinks[i].stage[WRITE_END], NULL, want, 0)
+                                : tee(src, sinks[i].stage[WRITE_END], want, 0);
+            } while (k < 0 && errno == EINTR);
+            if (k < 0) { perror("tee(fanout)"); rc = 1; live = 0; break; }
+            got[i] = n = k;	// later sinks ask for no more than every earlier one got
+            if (k == 0) { live = 0; break; }	// end of input
+        }
+        if (live == 0) break;
+
+        for (int i = 0; i < nsinks; i++) {
+            if (sinks[i].fd < 0) continue;
+            int ok = fanout_drain(&sinks[i], (size_t)n) == 0;
+            if (ok && got[i] > n) fanout_discard(&sinks[i], (size_t)(got[i] - n));
+            if (!ok) {
+                // discard what the dead sink left staged and stop feeding it
+                if (sinks[i].fd != STDOUT_FILENO) close(sinks[i].fd);
+                sinks[i].fd = -1;
+                close(sinks[i].stage[READ_END]);
+                close(sinks[i].stage[WRITE_END]);
+                live--;
+                rc = 1;
+            }
+        }
+    }
+    signal(SIGPIPE, old_pipe);
+
+    for (int i = 0; i < nsinks; i++) {
+        if (sinks[i].fd < 0) continue;
+        if (sinks[i].fd != STDOUT_FILENO) close(sinks[i].fd);
+        close(sinks[i].stage[READ_END]);
+        close(sinks[i].stage[WRITE_END]);
+    }
+    if (feed[READ_END] >= 0) close(feed[READ_END]);
+    if (feed[WRITE_END] >= 0) close(feed[WRITE_END]);
+
+    // pipelines finish once their input closes
+    for (int i = 0; i < npids; i++) {
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) { /* retry */ }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = 1;
+    }
+    return rc;
+}
+
+// --- FAN-IN ---
+/* "fanin <(pipeline) ..." runs every producer at once on a shell-owned pipe
+ * and merges them onto stdout. epoll picks whichever pipe is readable; only
+ * complete lines are written, so lines from different producers never
+ * interleave mid-line. Once a single producer is left there is nothing to
+ * interleave with and the rest of its output is splice(2)d straight through. */
+#define FANIN_BUF (64 * 1024)
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} FanSrc;
+
+// write out the complete lines buffered for src (all of it at EOF)
+static int fanin_flush (FanSrc *src, int eof) {
+    size_t n = src->len;
+    if (!eof) {
+        const char *nl = memrchr(src->buf, '\n', n);
+        // a line longer than the buffer cannot stay whole; it goes out in pieces
+        if (nl != NULL) n = (size_t)(nl - src->buf) + 1;
+        else if (n < FANIN_BUF) n = 0;
+    }
+    if (n == 0) return 0;
+    if (write_all(STDOUT_FILENO, src->buf, n) < 0) return -1;
+    memmove(src->buf, src->buf + n, src->len - n);
+    src->len -= n;
+    return 0;
+}
+
+static int fanin_passthrough (FanSrc *src) {
+    if (fanin_flush(src, 1) < 0) return -1;
+    for (;;) {
+        ssize_t n = splice(src->fd, NULL, STDOUT_FILENO, NULL, FANIN_BUF, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) break;	// stdout is no pipe and not spliceable
+        if (n <= 0) return (int)n;
+    }
+    for (;;) {
+        ssize_t n = read(src->fd, src->buf, FANIN_BUF);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return (int)n;
+        if (write_all(STDOUT_FILENO, src->buf, (size_t)n) < 0) return -1;
+    }
+}
+
+/* merge srcs (fd < 0 entries are skipped) onto stdout until every one is at
+ * EOF; closes them and returns -1 if stdout went away */
+static int fanin_merge (FanSrc *srcs, int nsrc) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) { perror("epoll_create1"); exit(1); }
+    int live = 0, rc = 0;
+    for (int i = 0; i < nsrc; i++) {
+        if (srcs[i].fd < 0) continue;
+        srcs[i].buf = malloc(FANIN_BUF);
+        srcs[i].len = 0;
+        if (!srcs[i].buf) { perror("malloc(fanin)"); exit(1); }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, srcs[i].fd, &ev) < 0) { perror("epoll_ctl"); exit(1); }
+        live++;
+    }
+
+    struct epoll_event evs[16];
+    while (live > 1) {
+        int n = epoll_wait(ep, evs, 16, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { perror("epoll_wait"); rc = -1; break; }
+        for (int e = 0; e < n && live > 1; e++) {
+            FanSrc *src = &srcs[evs[e].data.u32];
+            ssize_t r;
+            do { r = read(src->fd, src->buf + src->len, FANIN_BUF - src->len); } while (r < 0 && errno == EINTR);
+            if (r > 0) src->len += (size_t)r;
+            if (fanin_flush(src, r <= 0) < 0) { live = 0; rc = -1; break; }	// consumer went away
+            if (r <= 0) {
+                epoll_ctl(ep, EPOLL_CTL_DEL, src->fd, NULL);
+                close(src->fd);
+                src->fd = -1;
+                live--;
+            }
+        }
+    }
+    for (int i = 0; i < nsrc && live == 1; i++) {
+        if (srcs[i].fd >= 0 && fanin_passthrough(&srcs[i]) < 0) rc = -1;
+    }
+
+    for (int i = 0; i < nsrc; i++) {
+        if (srcs[i].fd >= 0) close(srcs[i].fd);
+        srcs[i].fd = -1;
+        free(srcs[i].buf);
+        srcs[i].buf = NULL;
+    }
+    close(ep);
+    return rc;
+}
+
+static int bi_fanin (Cmd *cmd) {
+    if (cmd->argc < 2) { puts("usage: fanin <(command) ..."); return 1; }
+    int nsrc = cmd->argc - 1;
+    FanSrc *srcs = calloc((size_t)nsrc, sizeof(FanSrc));
+    pid_t *pids = calloc((size_t)nsrc, sizeof(pid_t));
+    if (!srcs || !pids) { perror("calloc(fanin)"); exit(1); }
+
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+
+    int npids = 0, rc = 0;
+    for (int i = 0; i < nsrc; i++) {
+        const char *w = cmd->argv[i + 1];
+        srcs[i].fd = -1;
+        if (w[0] != '<' || w[1] != '(') { fprintf(stderr, "fanin: %s: expected <(command)\n", w); rc = 1; continue; }
+        srcs[i].fd = procsub_spawn("fanin", w, &pids[npids]);
+        if (srcs[i].fd < 0) { rc = 1; continue; }
+        npids++;
+    }
+    if (fanin_merge(srcs, nsrc) < 0) rc = 1;
+    signal(SIGPIPE, old_pipe);
+
+    // merged status: 0 only when every producer succeeded
+    for (int i = 0; i < npids; i++) {
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) { /* retry */ }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = 1;
+    }
+    free(srcs);
+    free(pids);
+    return rc;
+}
+
+// --- SHARD ---
+/* "shard [-n N] [-r] command [args]" runs N copies of command (default: one
+ * per CPU) and deals its input out to them in newline-aligned chunks, to the
+ * copy with the least unread input (or round-robin with -r). A second thread
+ * merges their outputs back line-atomically with fanin_merge. The status is
+ * the highest status of any copy. */
+#define SHARD_CHUNK (64 * 1024)
+#define SHARD_MAX 64
+
+typedef struct {
+    FanSrc *outs;
+    int n;
+    int rc;
+} ShardMerge;
+
+static void *shard_merge_thread (void *arg) {
+    ShardMerge *m = (ShardMerge *)arg;
+    m->rc = fanin_merge(m->outs, m->n);
+    return NULL;
+}
+
+// live worker with the least input still queued in its pipe
+static int shard_pick (const int *in, int n, int *next, int round_robin) {
+    int best = -1, best_q = INT_MAX;
+    for (int k = 0; k < n; k++) {
+        int i = (*next + k) % n;
+        if (in[i] < 0) continue;
+        if (round_robin) { best = i; break; }
+        int q = 0;
+        if (ioctl(in[i], FIONREAD, &q) < 0) q = 0;
+        if (q < best_q) { best = i; best_q = q; }
+        if (q == 0) break;
+    }
+    if (best >= 0) *next = (best + 1) % n;
+    return best;
+}
+
+static int bi_shard (Cmd *cmd) {
+    int n = 0, round_robin = 0, first = 1;
+    for (; first < cmd->argc && cmd->argv[first][0] == '-'; first++) {
+        if (strcmp(cmd->argv[first], "-r") == 0) round_robin = 1;
+        else if (strcmp(cmd->argv[first], "-n") == 0 && first + 1 < cmd->argc) n = atoi(cmd->argv[++first]);
+        else break;
+    }
+    if (first >= cmd->argc) { puts("usage: shard [-n copies] [-r] command [args ...]"); return 1; }
+    if (n <= 0) {
+        cpu_set_t cpus;
+        n = (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) ? CPU_COUNT(&cpus) : 1;
+    }
+    if (n > SHARD_MAX) n = SHARD_MAX;
+
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+
+    int in[SHARD_MAX];
+    FanSrc outs[SHARD_MAX];
+    pid_t pids[SHARD_MAX];
+    memset(outs, 0, sizeof(outs));
+    for (int i = 0; i < n; i++) {
+        int ip[2], op[2];
+        if (pipe2(ip, O_CLOEXEC) < 0 || pipe2(op, O_CLOEXEC) < 0) { perror("pipe(shard)"); exit(1); }
+        pids[i] = fork();
+        if (pids[i] < 0) { perror("fork(shard)"); exit(1); }
+        if (pids[i] == 0) {
+            if (dup2(ip[READ_END], STDIN_FILENO) < 0 || dup2(op[WRITE_END], STDOUT_FILENO) < 0) { perror("dup2(shard)"); _exit(1); }
+            signal(SIGPIPE, SIG_DFL);
+            exec_search(cmd->argv + first);
+            perror(cmd->argv[first]);
+            _exit(127);
+        }
+        close(ip[READ_END]);
+        close(op[WRITE_END]);
+        in[i] = ip[WRITE_END];
+        outs[i].fd = op[READ_END];
+    }
+
+    ShardMerge merge = { outs, n, 0 };
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, shard_merge_thread, &merge) != 0) { perror("pthread_create(shard)"); exit(1); }
+
+    // deal out chunks that end on a newline; a line longer than the chunk is split
+    char *buf = malloc(SHARD_CHUNK);
+    if (!buf) { perror("malloc(shard)"); exit(1); }
+    size_t len = 0;
+    int next = 0, live = n;
+    for (int eof = 0; !eof && live > 0; ) {
+        ssize_t r = read(STDIN_FILENO, buf + len, SHARD_CHUNK - len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) eof = 1;
+        else len += (size_t)r;
+
+        size_t cut = len;
+        if (!eof) {
+            const char *nl = memrchr(buf, '\n', len);
+            if (nl != NULL) cut = (size_t)(nl - buf) + 1;
+            else if (len < SHARD_CHUNK) continue;
+        }
+        while (cut > 0 && live > 0) {
+            int w = shard_pick(in, n, &next, round_robin);
+            if (write_all(in[w], buf, cut) == 0) break;
+            close(in[w]);	// that copy quit early; the chunk goes to another
+            in[w] = -1;
+            live--;
+        }
+        memmove(buf, buf + cut, len - cut);
+        len -= cut;
+    }
+    free(buf);
+    for (int i = 0; i < n; i++) if (in[i] >= 0) close(in[i]);
+
+    pthread_join(tid, NULL);
+    signal(SIGPIPE, old_pipe);
+
+    int rc = merge.rc < 0 ? 1 : 0;
+    for (int i = 0; i < n; i++) {
+        int status = 0;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) { /* retry */ }
+        int st = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (st > rc) rc = st;
+    }
+    return rc;
+}
+
+// --- MEMO ---
+/* "memo cmd args ..." caches cmd's stdout. The key is a 128-bit hash of
+ * argv, the working directory, the environment variables named in
+ * OSH_MEMO_ENV (default MEMO_ENV), the executable's identity and that of
+ * every argument naming an existing file, and the stage's "<" or piped input.
+ * Files count by device, inode, size and mtime, or by content when
+ * OSH_MEMO_HASH=1. Piped input is read into a memfd first so it can be hashed
+ * and then handed to cmd. Outputs of successful runs live in a content-
+ * addressed store under OSH_MEMO_DIR (default ~/.cache/osh/memo):
+ * objects/<output hash>, with keys/<key> a symlink to its object. A hit is
+ * replayed with sendfile(2) and runs nothing. */
+#define MEMO_ENV "PATH LANG LC_ALL LC_CTYPE LC_COLLATE LC_NUMERIC TZ"
+#define MEMO_CHUNK (64 * 1024)
+
+typedef struct {
+    uint64_t h[2];
+    uint64_t total;
+    unsigned char tail[16];
+    size_t ntail;
+} MemoHash;
+
+static uint64_t rotl64 (uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t fmix64 (uint64_t k) {
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+    return k ^ (k >> 33);
+}
+
+// MurmurHash3 x64_128 block step
+static void mh_block (MemoHash *m, const unsigned char *b) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t k1, k2;
+    memcpy(&k1, b, 8);
+    memcpy(&k2, b + 8, 8);
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; m->h[0] ^= k1;
+    m->h[0] = rotl64(m->h[0], 27) + m->h[1]; m->h[0] = m->h[0] * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; m->h[1] ^= k2;
+    m->h[1] = rotl64(m->h[1], 31) + m->h[0]; m->h[1] = m->h[1] * 5 + 0x38495ab5;
+}
+
+static void mh_init (MemoHash *m) { memset(m, 0, sizeof(*m)); }
+
+static void mh_update (MemoHash *m, const void *data, size_t len) {
+    const unsigned char *p = data;
+    m->total += len;
+    if (m->ntail > 0) {
+        size_t take = 16 - m->ntail < len ? 16 - m->ntail : len;
+        memcpy(m->tail + m->ntail, p, take);
+        m->ntail += take;
+        p += take;
+        len -= take;
+        if (m->ntail < 16) return;
+        mh_block(m, m->tail);
+        m->ntail = 0;
+    }
+    for (; len >= 16; p += 16, len -= 16) mh_block(m, p);
+    memcpy(m->tail, p, len);
+    m->ntail = len;
+}
+
+// MurmurHash3 x64_128 tail and finalization; 32 hex digits
+static void mh_final (MemoHash *m, char hex[33]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = m->ntail; i > 8; i--) k2 = (k2 << 8) | m->tail[i - 1];
+    for (size_t i = m->ntail < 8 ? m->ntail : 8; i > 0; i--) k1 = (k1 << 8) | m->tail[i - 1];
+    if (m->ntail > 8) { k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; m->h[1] ^= k2; }
+    if (m->ntail > 0) { k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; m->h[0] ^= k1; }
+    uint64_t h1 = m->h[0] ^ m->total, h2 = m->h[1] ^ m->total;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    snprintf(hex, 33, "%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2);
+}
+
+// a length-prefixed field, so that ("ab", "c") and ("a", "bc") differ
+static void mh_field (MemoHash *m, const char *tag, const void *data, size_t len) {
+    uint64_t n = len;
+    mh_update(m, tag, strlen(tag) + 1);
+    mh_update(m, &n, sizeof(n));
+    mh_update(m, data, len);
+}
+
+// hash what fd holds from offset off to its end; -1 on a read error
+static int mh_fd (MemoHash *m, int fd, off_t off) {
+    char *buf = malloc(MEMO_CHUNK);
+    if (!buf) { perror("malloc(memo)"); exit(1); }
+    ssize_t n;
+    while ((n = pread(fd, buf, MEMO_CHUNK, off)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { free(buf); return -1; }
+        mh_update(m, buf, (size_t)n);
+        off += n;
+    }
+    free(buf);
+    return 0;
+}
+
+// a file by identity, or by content for OSH_MEMO_HASH=1
+static void mh_file (MemoHash *m, const char *tag, int fd, const struct stat *st, off_t off, int by_content) {
+    if (by_content && S_ISREG(st->st_mode) && mh_fd(m, fd, off) == 0) return;
+    uint64_t id[6] = { st->st_dev, st->st_ino, (uint64_t)st->st_size, (uint64_t)st->st_mtim.tv_sec, (uint64_t)st->st_mtim.tv_nsec, (uint64_t)off };
+    mh_field(m, tag, id, sizeof(id));
+}
+
+// stat the file PATH would run for name
+static int memo_which (const char *name, struct stat *st) {
+    if (strchr(name, '/') != NULL) return stat(name, st);
+    const char *path = var_get("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    char full[PATH_MAX];
+    for (const char *dir = path; ; dir++) {
+        const char *end = strchrnul(dir, ':');
+        int n = snprintf(full, sizeof(full), "%.*s/%s", end == dir ? 1 : (int)(end - dir), end == dir ? "." : dir, name);
+        if (n > 0 && (size_t)n < sizeof(full) && stat(full, st) == 0 && S_ISREG(st->st_mode) && access(full, X_OK) == 0) return 0;
+        if (*end == '\0') return -1;
+        dir = end;
+    }
+}
+
+static int memo_mkdirs (char *path) {
+    for (char *s = path + 1; *s; s++) {
+        if (*s != '/') continue;
+        *s = '\0';
+        int rc = mkdir(path, 0755);
+        *s = '/';
+        if (rc < 0 && errno != EEXIST) return -1;
+    }
+    return (mkdir(path, 0755) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+static int memo_store (char *dir, size_t size) {
+    const char *d = var_get("OSH_MEMO_DIR");
+    const char *home = var_get("HOME");
+    if (d) snprintf(dir, size, "%s", d);
+    else snprintf(dir, size, "%s/.cache/osh/memo", home ? home : "/tmp");
+    char sub[PATH_MAX + 16];
+    snprintf(sub, sizeof(sub), "%s/objects", dir);
+    if (memo_mkdirs(sub) < 0) return -1;
+    snprintf(sub, sizeof(sub), "%s/keys", dir);
+    return memo_mkdirs(sub);
+}
+
+// copy a stored output to stdout, in the kernel when it allows
+static int memo_replay (int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    off_t off = 0;
+    while (off < st.st_size) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, &off, (size_t)(st.st_size - off));
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) continue;
+        if (n == 0) break;
+
+        // the kernel refused (EINVAL, e.g. stdout in append mode): copy by hand
+        char *buf = malloc(MEMO_CHUNK);
+        if (!buf) { perror("malloc(memo)"); exit(1); }
+        ssize_t r;
+        while ((r = pread(fd, buf, MEMO_CHUNK, off)) > 0 && write_all(STDOUT_FILENO, buf, (size_t)r) == 0) off += r;
+        free(buf);
+        return r == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+// run argv with stdout through a pipe, copying it to stdout and to tmp while hashing it
+static int memo_run (Cmd *cmd, int tmp, MemoHash *out) {
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0) { perror("pipe(memo)"); return 1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork(memo)"); close(fd[READ_END]); close(fd[WRITE_END]); return 1; }
+    if (pid == 0) {
+        if (dup2(fd[WRITE_END], STDOUT_FILENO) < 0) { perror("dup2(memo)"); _exit(1); }
+        status_fd = -1;
+        drop_cloexec_fds();
+        exec_stage(cmd);
+    }
+    close(fd[WRITE_END]);
+
+    char *buf = malloc(MEMO_CHUNK);
+    if (!buf) { perror("malloc(memo)"); exit(1); }
+    int ok = 1;
+    for (;;) {
+        ssize_t n = read(fd[READ_END], buf, MEMO_CHUNK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        mh_update(out, buf, (size_t)n);
+        if (ok && write_all(tmp, buf, (size_t)n) < 0) ok = 0;
+        if (write_all(STDOUT_FILENO, buf, (size_t)n) < 0) { ok = 0; break; }
+    }
+    free(buf);
+    close(fd[READ_END]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) { /* retry */ }
+    int rc = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return (rc == 0 && !ok) ? -1 : rc;
+}
+
+static int bi_memo (Cmd *cmd) {
+    if (cmd->argc < 2) { puts("usage: memo command [args ...]"); return 2; }
+    const char *hv = var_get("OSH_MEMO_HASH");
+    int by_content = hv != NULL && strcmp(hv, "1") == 0;
+
+    MemoHash key;
+    mh_init(&key);
+    for (int i = 1; i < cmd->argc; i++) mh_field(&key, "arg", cmd->argv[i], strlen(cmd->argv[i]));
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != NULL) mh_field(&key, "cwd", cwd, strlen(cwd));
+
+    const char *names = var_get("OSH_MEMO_ENV");
+    if (names == NULL) names = MEMO_ENV;
+    for (const char *s = names; *s; ) {
+        size_t n = strcspn(s, " :,");
+        if (n > 0) {
+            const char *val = var_get_n(s, n);
+            mh_field(&key, "env", s, n);
+            mh_field(&key, "val", val ? val : "", val ? strlen(val) : 0);
+        }
+        s += n;
+        if (*s) s++;
+    }
+
+    struct stat st;
+    if (find_builtin(cmd->argv[1]) == NULL && memo_which(cmd->argv[1], &st) == 0) mh_file(&key, "exe", -1, &st, 0, 0);
+    for (int i = 2; i < cmd->argc; i++) {
+        int fd = open(cmd->argv[i], O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        if (fd < 0) continue;
+        if (fstat(fd, &st) == 0) mh_file(&key, "file", fd, &st, 0, by_content);
+        close(fd);
+    }
+
+    // a pipe is read to its end into a memfd, which then becomes cmd's stdin
+    if (memo_input) {
+        if (fstat(STDIN_FILENO, &st) == 0 && !S_ISREG(st.st_mode)) {
+            int mfd = memfd_create("osh-memo", MFD_CLOEXEC);
+            if (mfd < 0) { perror("memfd_create(memo)"); return 1; }
+            ssize_t n;
+            do { n = splice(STDIN_FILENO, NULL, mfd, NULL, 1 << 30, 0); } while (n > 0 || (n < 0 && errno == EINTR));
+            if (n < 0) {
+                // not spliceable (a tty or socket): copy
+                char *buf = malloc(MEMO_CHUNK);
+                if (!buf) { perror("malloc(memo)"); exit(1); }
+                while ((n = read(STDIN_FILENO, buf, MEMO_CHUNK)) > 0 || (n < 0 && errno == EINTR)) {
+                    if (n > 0 && write_all(mfd, buf, (size_t)n) < 0) break;
+                }
+                free(buf);
+            }
+            if (dup2(mfd, STDIN_FILENO) < 0 || lseek(STDIN_FILENO, 0, SEEK_SET) < 0) { perror("dup2(memo)"); close(mfd); return 1; }
+            close(mfd);
+            mh_update(&key, "stdin", 6);
+            mh_fd(&key, STDIN_FILENO, 0);
+        } else if (fstat(STDIN_FILENO, &st) == 0) {
+            // here-documents are new memfds every run: only their content says anything
+            char link[32];
+            ssize_t n = readlink("/proc/self/fd/0", link, sizeof(link) - 1);
+            int memfd = n > 7 && strncmp(link, "/memfd:", 7) == 0;
+            mh_file(&key, "stdin", STDIN_FILENO, &st, lseek(STDIN_FILENO, 0, SEEK_CUR), by_content || memfd);
+        }
+    }
+
+    char hex[33];
+    mh_final(&key, hex);
+    char dir[PATH_MAX], keypath[PATH_MAX + 64];
+    Cmd run; cmd_init(&run);
+    for (int i = 1; i < cmd->argc; i++) {
+        char *w = strdup(cmd->argv[i]);
+        if (!w) { perror("strdup(memo)"); exit(1); }
+        cmd_push_arg(&run, w);
+    }
+    if (memo_store(dir, sizeof(dir)) < 0) {
+        // no store: just run it
+        perror("memo: store");
+        int tmp = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        MemoHash out; mh_init(&out);
+        int rc = memo_run(&run, tmp, &out);
+        close(tmp);
+        free_cmd(&run);
+        return rc < 0 ? 1 : rc;
+    }
+    snprintf(keypath, sizeof(keypath), "%s/keys/%s", dir, hex);
+
+    int hit = open(keypath, O_RDONLY | O_CLOEXEC);
+    if (hit >= 0) {
+        memo_counts->hits++;
+        int rc = memo_replay(hit) < 0 ? 1 : 0;
+        close(hit);
+        free_cmd(&run);
+        return rc;
+    }
+    memo_counts->misses++;
+
+    char tmppath[PATH_MAX + 64];
+    snprintf(tmppath, sizeof(tmppath), "%s/objects/.tmp.XXXXXX", dir);
+    int tmp = mkostemp(tmppath, O_CLOEXEC);
+    if (tmp < 0) perror("memo: mkstemp");
+    MemoHash out; mh_init(&out);
+    int rc = memo_run(&run, tmp, &out);
+    free_cmd(&run);
+    if (tmp < 0) return rc < 0 ? 1 : rc;
+    close(tmp);
+    if (rc != 0) { unlink(tmppath); return rc < 0 ? 1 : rc; }
+
+    // publish: the object under its content hash (shared by equal outputs), then the key
+    char ohex[33], objpath[PATH_MAX + 64], target[64], linktmp[PATH_MAX + 96];
+    mh_final(&out, ohex);
+    snprintf(objpath, sizeof(objpath), "%s/objects/%s", dir, ohex);
+    if (rename(tmppath, objpath) < 0) { perror("memo: rename"); unlink(tmppath); return 0; }
+    snprintf(target, sizeof(target), "../objects/%s", ohex);
+    snprintf(linktmp, sizeof(linktmp), "%s/keys/.%s.%d", dir, hex, (int)getpid());
+    if (symlink(target, linktmp) < 0 || rename(linktmp, keypath) < 0) { perror("memo: symlink"); unlink(linktmp); }
+    return 0;
+}
+
+// --- COMPLETION ---
+/* Command names for Tab completion live in a trie built from PATH on first
+ * use. Each node records which PATH directories (one bit each, the top bit
+ * for builtins) provide the name ending there, so a binary appearing in two
+ * directories survives the removal of one copy. An inotify watch on every
+ * PATH directory is drained before each lookup to keep the trie current
+ * without rescanning; a changed PATH, a lost event (queue overflow) or a
+ * PATH directory removed or moved away rebuilds it. */
+#define TRIE_MAX_DIRS 63
+#define TRIE_BUILTIN (1ULL << 63)
+
+typedef struct {
+    uint32_t child, sibling;	// node indices, 0 for none (0 is the root)
+    uint64_t dirs;	// providers of the name ending here
+    char c;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;
+    uint32_t len, cap;
+    char *path;	// PATH the trie was built from
+    char *dirs[TRIE_MAX_DIRS];
+    int wds[TRIE_MAX_DIRS];
+    int ndirs;
+    int ifd;	// inotify, -1 when unavailable
+} ExecTrie;
+
+static ExecTrie exec_trie = { NULL, 0, 0, NULL, { NULL }, { 0 }, 0, -1 };
+
+static uint32_t trie_node (ExecTrie *t, char c) {
+    if (t->len == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 4096;
+        t->nodes = (TrieNode *)realloc(t->nodes, sizeof(TrieNode) * t->cap);
+        if (!t->nodes) { perror("realloc(trie)"); exit(1); }
+    }
+    t->nodes[t->len] = (TrieNode){ 0, 0, 0, c };
+    return t->len++;
+}
+
+// node for prefix s; with !create a missing prefix gives *found = 0
+static uint32_t trie_walk (ExecTrie *t, const char *s, size_t len, int create, int *found) {
+    uint32_t n = 0;
+    *found = 1;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        // siblings are kept sorted so listings come out in order
+        uint32_t prev = 0, cur = t->nodes[n].child;
+        while (cur && (unsigned char)t->nodes[cur].c < c) { prev = cur; cur = t->nodes[cur].sibling; }
+        if (cur == 0 || (unsigned char)t->nodes[cur].c != c) {
+            if (!create) { *found = 0; return 0; }
+            uint32_t m = trie_node(t, s[i]);	// may move nodes; indices stay valid
+            t->nodes[m].sibling = cur;
+            if (prev) t->nodes[prev].sibling = m;
+            else t->nodes[n].child = m;
+            cur = m;
+        }
+        n = cur;
+    }
+    return n;
+}
+
+static void trie_mark (ExecTrie *t, const char *name, uint64_t bit, int set) {
+    int found;
+    uint32_t n = trie_walk(t, name, strlen(name), set, &found);
+    if (!found) return;
+    if (set) t->nodes[n].dirs |= bit;
+    else t->nodes[n].dirs &= ~bit;
+}
+
+// a regular file we may execute
+static int is_exec_at (int dfd, const char *name, unsigned char d_type) {
+    if (d_type == DT_DIR) return 0;
+    if (d_type != DT_REG) {
+        struct stat st;
+        if (fstatat(dfd, name, &st, 0) < 0 || !S_ISREG(st.st_mode)) return 0;
+    }
+    return faccessat(dfd, name, X_OK, 0) == 0;
+}
+
+static void trie_free (ExecTrie *t) {
+    free(t->nodes);
+    free(t->path);
+    for (int i = 0; i < t->ndirs; i++) free(t->dirs[i]);
+    if (t->ifd >= 0) close(t->ifd);
+    *t = (ExecTrie){ NULL, 0, 0, NULL, { NULL }, { 0 }, 0, -1 };
+}
+
+static void trie_build (ExecTrie *t, const char *path) {
+    trie_free(t);
+    trie_node(t, '\0');
+    t->path = strdup(path);
+    if (!t->path) { perror("strdup(trie)"); exit(1); }
+    t->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) trie_mark(t, builtins[i].name, TRIE_BUILTIN, 1);
+
+    for (const char *dir = path; t->ndirs < TRIE_MAX_DIRS; dir++) {
+        const char *end = strchrnul(dir, ':');
+        char *d = (end == dir) ? strdup(".") : strndup(dir, (size_t)(end - dir));
+        if (!d) { perror("strdup(trie)"); exit(1); }
+        int idx = t->ndirs++;
+        t->dirs[idx] = d;
+        t->wds[idx] = t->ifd >= 0 ? inotify_add_watch(t->ifd, d, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR) : -1;
+
+        DIR *dp = opendir(d);
+        if (dp != NULL) {
+            for (struct dirent *e; (e = readdir(dp)) != NULL; ) {
+                if (e->d_name[0] == '.') continue;
+                if (is_exec_at(dirfd(dp), e->d_name, e->d_type)) trie_mark(t, e->d_name, 1ULL << idx, 1);
+            }
+            closedir(dp);
+        }
+        if (*end == '\0') break;
+        dir = end;
+    }
+}
+
+// apply queued inotify events; rebuild when PATH itself changed
+static void trie_refresh (ExecTrie *t) {
+    const char *path = var_get("PATH");
+    if (path == NULL) path = "/usr/local/bin:/usr/bin:/bin";
+    if (t->path == NULL || strcmp(path, t->path) != 0) { trie_build(t, path); return; }
+    if (t->ifd < 0) return;
+
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(t->ifd, buf, sizeof(buf));
+        if (n <= 0) return;
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) { trie_build(t, path); return; }
+            if (ev->len == 0 || ev->name[0] == '.') continue;
+            int idx = 0;
+            while (idx < t->ndirs && t->wds[idx] != ev->wd) idx++;
+            if (idx == t->ndirs) continue;
+            int present = 0;
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+                int dfd = open(t->dirs[idx], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (dfd >= 0) { present = is_exec_at(dfd, ev->name, DT_UNKNOWN); close(dfd); }
+            }
+            trie_mark(t, ev->name, 1ULL << idx, present);
+        }
+    }
+}
+
+// collect up to max names under node n (prefix in name[0..len))
+static void trie_collect (ExecTrie *t, uint32_t n, char *name, size_t len, size_t size, GlobOut *out, size_t max) {
+    if (out->len >= max) return;
+    if (t->nodes[n].dirs) glob_out_push(out, name, len);
+    if (len + 1 >= size) return;
+    for (uint32_t c = t->nodes[n].child; c && out->len < max; c = t->nodes[c].sibling) {
+        name[len] = t->nodes[c].c;
+        trie_collect(t, c, name, len + 1, size, out, max);
+    }
+}
+
+// shorten lcp (length *n) to what it shares with s
+static void lcp_merge (char *lcp, size_t *n, const char *s) {
+    size_t i = 0;
+    while (i < *n && lcp[i] == s[i]) i++;
+    *n = i;
+    lcp[i] = '\0';
+}
+
+/* Command names completing prefix: up to max of them (sorted) into out and
+ * their longest common prefix into lcp. Returns the number of matches,
+ * counting no further than max + 1. */
+static size_t complete_command (const char *prefix, size_t len, char *lcp, size_t lcp_size, GlobOut *out, size_t max) {
+    trie_refresh(&exec_trie);
+    int found;
+    uint32_t n = trie_walk(&exec_trie, prefix, len, 0, &found);
+    if (!found || len >= lcp_size) return 0;
+
+    // the common prefix runs down the trie while there is no choice to make
+    memcpy(lcp, prefix, len);
+    size_t l = len;
+    for (uint32_t m = n; exec_trie.nodes[m].dirs == 0 && l + 1 < lcp_size; l++) {
+        uint32_t c = exec_trie.nodes[m].child;
+        if (c == 0 || exec_trie.nodes[c].sibling != 0) break;
+        lcp[l] = exec_trie.nodes[c].c;
+        m = c;
+    }
+    lcp[l] = '\0';
+
+    char name[PATH_MAX];
+    memcpy(name, prefix, len);
+    trie_collect(&exec_trie, n, name, len, sizeof(name), out, max + 1);
+    return out->len;
+}
+
+// the same for a path word; directories get a trailing '/'
+static size_t complete_path (const char *word, size_t len, char *lcp, size_t lcp_size, GlobOut *out, size_t max) {
+    const char *slash = NULL;
+    for (size_t i = 0; i < len; i++) if (word[i] == '/') slash = word + i;
+    char dir[PATH_MAX];
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    if (dlen >= sizeof(dir)) return 0;
+    if (dlen) memcpy(dir, word, dlen);
+    dir[dlen] = '\0';
+    const char *base = word + dlen;
+    size_t blen = len - dlen;
+
+    DIR *dp = opendir(dlen ? dir : ".");
+    if (dp == NULL) return 0;
+    char full[PATH_MAX];
+    size_t count = 0, l = 0;
+    for (struct dirent *e; (e = readdir(dp)) != NULL; ) {
+        if (strncmp(e->d_name, base, blen) != 0) continue;
+        if (e->d_name[0] == '.' && (blen == 0 || base[0] != '.')) continue;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        int n = snprintf(full, sizeof(full), "%s%s%s", dir, e->d_name, is_dir_at(dirfd(dp), e->d_name, e->d_type) ? "/" : "");
+        if (n <= 0 || (size_t)n >= sizeof(full)) continue;
+        if (count++ == 0) { l = (size_t)n < lcp_size ? (size_t)n : lcp_size - 1; memcpy(lcp, full, l); lcp[l] = '\0'; }
+        else lcp_merge(lcp, &l, full);
+        if (out->len <= max) glob_out_push(out, full, (size_t)n);
+    }
+    closedir(dp);
+    qsort(out->paths, out->len, sizeof(char *), cmp_str);
+    return count;
+}
+
+// --- LINE EDITOR ---
+/* Minimal raw-mode editor used when stdin and stdout are a terminal: cursor
+ * movement, Up/Down through history and Ctrl-R incremental reverse search
+ * (served by history_search, so it stays fast on huge histories). */
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+typedef struct {
+    char *buf;
+    size_t size, len, pos;
+    const char *prompt;
+} LineEd;
+
+static void ed_write (const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        if (w < 0) { if (errno == EINTR) continue; return; }
+        s += w;
+        n -= (size_t)w;
+    }
+}
+
+static void ed_refresh (const LineEd *ed) {
+    char seq[32];
+    ed_write("\r", 1);
+    ed_write(ed->prompt, strlen(ed->prompt));
+    ed_write(ed->buf, ed->len);
+    ed_write("\x1b[K\r", 4);
+    size_t col = strlen(ed->prompt) + ed->pos;
+    if (col > 0) ed_write(seq, (size_t)snprintf(seq, sizeof(seq), "\x1b[%zuC", col));
+}
+
+static void ed_set (LineEd *ed, const char *line) {
+    snprintf(ed->buf, ed->size, "%s", line ? line : "");
+    ed->len = ed->pos = strlen(ed->buf);
+}
+
+static int ed_getc (void) {
+    unsigned char c;
+    for (;;) {
+        ssize_t r = read(STDIN_FILENO, &c, 1);
+        if (r == 1) return c;
+        if (r < 0 && errno == EINTR) continue;
+        return -1;
+    }
+}
+
+// Ctrl-R mode; returns the key that ended the search (the line holds the match)
+static int ed_reverse_search (LineEd *ed) {
+    char q[MAX_LINE] = "";
+    size_t qlen = 0;
+    uint64_t match = 0;
+    char saved[MAX_LINE];
+    snprintf(saved, sizeof(saved), "%s", ed->buf);
+
+    for (;;) {
+        const char *line = history_get(&history, match);
+        char status[2 * MAX_LINE + 64];
+        int n = snprintf(status, sizeof(status), "\r(%sreverse-i-search)`%s': %s\x1b[K",
+                         (qlen && !match) ? "failing " : "", q, line ? line : "");
+        ed_write(status, (size_t)n);
+
+        int c = ed_getc();
+        if (c == CTRL_KEY('r')) {
+            // next older match
+            uint64_t older = match ? history_search(&history, q, match) : 0;
+            if (older) match = older;
+            continue;
+        }
+        if (c == 127 || c == CTRL_KEY('h')) {
+            if (qlen > 0) q[--qlen] = '\0';
+        } else if (c >= 32 && c < 127 && qlen + 1 < sizeof(q)) {
+            q[qlen++] = (char)c;
+            q[qlen] = '\0';
+        } else {
+            if (c == CTRL_KEY('g')) ed_set(ed, saved);
+            else if (line) ed_set(ed, line);
+            return c;
+        }
+        match = qlen ? history_search(&history, q, history.next) : 0;
+    }
+}
+
+#define COMPLETE_LIST_MAX 100
+
+/* Tab: complete the word before the cursor as a command (first word of a
+ * stage, no '/') or as a path. A single match is finished off, several are
+ * completed to their common prefix, and a second Tab lists them. */
+static void ed_complete (LineEd *ed, int again) {
+    size_t start = ed->pos;
+    while (start > 0 && !is_ws(ed->buf[start - 1]) && strchr("|&<>(", ed->buf[start - 1]) == NULL) start--;
+    size_t before = start;
+    while (before > 0 && is_ws(ed->buf[before - 1])) before--;
+    const char *word = ed->buf + start;
+    size_t wlen = ed->pos - start;
+    int command = (before == 0 || strchr("|&(", ed->buf[before - 1]) != NULL) && memchr(word, '/', wlen) == NULL;
+
+    GlobOut out = { NULL, 0, 0 };
+    char lcp[PATH_MAX];
+    size_t count = command ? complete_command(word, wlen, lcp, sizeof(lcp), &out, COMPLETE_LIST_MAX)
+                           : complete_path(word, wlen, lcp, sizeof(lcp), &out, COMPLETE_LIST_MAX);
+
+    size_t llen = count ? strlen(lcp) : 0;
+    if (count == 1 && llen > 0 && lcp[llen - 1] != '/' && llen + 1 < sizeof(lcp)) { lcp[llen++] = ' '; lcp[llen] = '\0'; }
+    if (count > 0 && llen > wlen && ed->len + (llen - wlen) < ed->size) {
+        size_t add = llen - wlen;
+        memmove(ed->buf + ed->pos + add, ed->buf + ed->pos, ed->len - ed->pos + 1);
+        memcpy(ed->buf + ed->pos, lcp + wlen, add);
+        ed->pos += add;
+        ed->len += add;
+    } else if (again && count > 1) {
+        ed_write("\r\n", 2);
+        for (size_t i = 0; i < out.len && i < COMPLETE_LIST_MAX; i++) {
+            const char *name = out.paths[i];
+            if (!command) {
+                // list base names, keeping a directory's trailing '/'
+                size_t nl = strlen(name);
+                const char *sl = nl > 1 ? memrchr(name, '/', nl - 1) : NULL;
+                if (sl) name = sl + 1;
+            }
+            ed_write(name, strlen(name));
+            ed_write("  ", 2);
+        }
+        if (count > COMPLETE_LIST_MAX) ed_write("...", 3);
+        ed_write("\r\n", 2);
+    } else if (count != 1) {
+        ed_write("\a", 1);
+    }
+    for (size_t i = 0; i < out.len; i++) free(out.paths[i]);
+    free(out.paths);
+}
+
+// read one line into buf; returns its length or -1 on EOF
+static int ed_readline (char *buf, size_t size, const char *prompt) {
+    struct termios orig, raw;
+    if (tcgetattr(STDIN_FILENO, &orig) < 0) return -1;
+    raw = orig;
+    raw.c_iflag &= ~(unsigned)(ICRNL | IXON);
+    raw.c_lflag &= ~(unsigned)(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    LineEd ed = { buf, size, 0, 0, prompt };
+    buf[0] = '\0';
+    uint64_t browse = history.next;	// entry shown by Up/Down, next == the new line
+    int result = 0;
+    ed_refresh(&ed);
+
+    for (int done = 0, prev = 0; !done; ) {
+        int c = ed_getc();
+        if (c == '\t') {
+            ed_complete(&ed, prev == '\t');
+            ed_refresh(&ed);
+            prev = c;
+            continue;
+        }
+        prev = c;
+        if (c == CTRL_KEY('r')) {
+            c = ed_reverse_search(&ed);
+            if (c == CTRL_KEY('g') || c == 27) c = 0;	// cancelled, or an escape sequence we drop
+        }
+        switch (c) {
+            case 0: break;
+            case -1: result = -1; done = 1; break;
+            case '\r': case '\n': done = 1; break;
+            case CTRL_KEY('c'): ed.len = ed.pos = 0; buf[0] = '\0'; ed_write("^C\r\n", 4); break;
+            case CTRL_KEY('d'):
+                if (ed.len == 0) { result = -1; done = 1; break; }
+                if (ed.pos < ed.len) { memmove(buf + ed.pos, buf + ed.pos + 1, ed.len - ed.pos); ed.len--; }
+                break;
+            case 127: case CTRL_KEY('h'):
+                if (ed.pos > 0) { memmove(buf + ed.pos - 1, buf + ed.pos, ed.len - ed.pos + 1); ed.pos--; ed.len--; }
+                break;
+            case CTRL_KEY('a'): ed.pos = 0; break;
+            case CTRL_KEY('e'): ed.pos = ed.len; break;
+            case CTRL_KEY('u'): ed.len = ed.pos = 0; buf[0] = '\0'; break;
+            case CTRL_KEY('k'): ed.len = ed.pos; buf[ed.len] = '\0'; break;
+            case 27: {
+                // ESC [ A/B/C/D/H/F
+                if (ed_getc() != '[') break;
+                int k = ed_getc();
+                if (k == 'A' && browse > history.first) ed_set(&ed, history_get(&history, --browse));
+                if (k == 'B' && browse < history.next) { browse++; ed_set(&ed, history_get(&history, browse)); }
+                if (k == 'C' && ed.pos < ed.len) ed.pos++;
+                if (k == 'D' && ed.pos > 0) ed.pos--;
+                if (k == 'H') ed.pos = 0;
+                if (k == 'F') ed.pos = ed.len;
+                break;
+            }
+            default:
+                if (c >= 32 && c < 256 && c != 127 && ed.len + 1 < size) {
+                    memmove(buf + ed.pos + 1, buf + ed.pos, ed.len - ed.pos + 1);
+                    buf[ed.pos++] = (char)c;
+                    ed.len++;
+                }
+        }
+        ed_refresh(&ed);
+    }
+
+    ed_write("\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+    return result < 0 ? -1 : (int)ed.len;
+}
+
+// --- SCRIPT INPUT ---
+/* Non-interactive input is read in INPUT_BUF blocks rather than through
+ * stdio. Children share the shell's stdin, so before anything runs
+ * input_sync() seeks a seekable input (a script file) back to the end of the
+ * last consumed line; a command that reads stdin then sees exactly the
+ * lines after its own, and whatever it consumes is skipped by the shell.
+ * A pipe cannot seek back: by default it is read in blocks (fast mode), so
+ * commands do not see the script's later lines. OSH_INPUT=exact reads pipes
+ * one byte at a time instead, the way a POSIX shell must. */
+#define INPUT_BUF (64 * 1024)
+
+typedef struct {
+    int fd;
+    int seekable;
+    int exact;
+    char buf[INPUT_BUF];
+    size_t pos, len;
+} Input;
+
+static Input script;
+
+static void input_init (Input *in, int fd) {
+    in->fd = fd;
+    in->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    const char *mode = var_get("OSH_INPUT");
+    in->exact = !in->seekable && mode != NULL && strcmp(mode, "exact") == 0;
+    in->pos = in->len = 0;
+}
+
+// next line (newline kept) like fgets: at most size - 1 bytes; -1 at EOF
+static int input_line (Input *in, char *line, size_t size) {
+    size_t n = 0;
+    while (n + 1 < size) {
+        if (in->pos == in->len) {
+            ssize_t r = read(in->fd, in->buf, in->exact ? 1 : sizeof(in->buf));
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            in->pos = 0;
+            in->len = (size_t)r;
+        }
+        char c = in->buf[in->pos++];
+        line[n++] = c;
+        if (c == '\n') break;
+    }
+    line[n] = '\0';
+    return n == 0 ? -1 : (int)n;
+}
+
+// give read-ahead back to a seekable input before children can see it
+static void input_sync (Input *in) {
+    if (!in->seekable || in->pos == in->len) return;
+    if (lseek(in->fd, -(off_t)(in->len - in->pos), SEEK_CUR) < 0) return;
+    in->pos = in->len = 0;
+}
+
+// --- HERE-DOCUMENTS ---
+/* Body lines of "<<WORD" follow the command line up to a line that is exactly
+ * WORD. They are kept in memory (parameters are expanded later with the rest
+ * of the command) and reach the child through a sealed memfd, so nothing is
+ * written to disk and no helper process is needed. */
+// lines come from in, or from the line editor when in is NULL
+static void read_heredocs (Cmd *node, Input *in) {
+    if (node == NULL) return;
+    read_heredocs(node->pipe_cmd, in);
+    if (node->heredoc_delim == NULL) return;
+
+    Str body = { NULL, 0, 0 };
+    str_putn(&body, "", 0);
+    char line[MAX_LINE];
+    int at_start = 1;	// a long line is handed over in pieces
+    for (;;) {
+        if (in == NULL) {
+            if (ed_readline(line, sizeof(line), "> ") < 0) break;
+            strcat(line, "\n");
+        } else {
+            if (input_line(in, line, sizeof(line)) < 0) break;
+        }
+        size_t len = strlen(line);
+        int whole = (len > 0 && line[len - 1] == '\n');
+        if (at_start && whole && len - 1 == strlen(node->heredoc_delim) && strncmp(line, node->heredoc_delim, len - 1) == 0) {
+            free(node->heredoc_delim);
+            node->heredoc_delim = NULL;
+            node->redir_in_data = body.p;
+            return;
+        }
+        str_putn(&body, line, len);
+        at_start = whole;
+    }
+    printf("warning: here-document delimited by end-of-file (wanted `%s')\n", node->heredoc_delim);
+    free(node->heredoc_delim);
+    node->heredoc_delim = NULL;
+    node->redir_in_data = body.p;
+}
+
+// --- CONTROL FLOW ---
+/* "if", "while"/"until", "for" and "case" may span several lines. The whole
+ * construct is read and compiled before any of it runs: conditions become
+ * jumps on $?, so a loop body is parsed once however often it runs.
+ * Redirections after the closing "fi", "done" or "esac" are opened once and
+ * put on the shell's own descriptors around the construct. */
+static const char *const reserved[] = { "if", "then", "elif", "else", "fi", "while", "until", "for", "do", "done", "case", "esac", NULL };
+
+// the lines of a construct: the rest of a script, or the line editor at the prompt
+typedef struct {
+    Input *in;	// NULL: the line editor
+    const char *name;	// script name for messages, NULL at the prompt
+    int lineno;
+    char line[MAX_LINE];
+    Lexer lx;
+    int have;	// lx holds unparsed text
+    int one_line;	// no lines beyond the current one ("$(...)")
+    int skip;	// "&&"/"||" jumps over the next statement, patched once it is compiled
+    TokKind close_sep;	// separator after the last closing "fi", "done" or "esac"
+} Source;
+
+static void src_init (Source *s, Input *in, const char *name) {
+    s->in = in;
+    s->name = name;
+    s->lineno = 0;
+    s->have = 0;
+    s->one_line = 0;
+    s->skip = -1;
+}
+
+// continue from a line whose first statement was parsed by the caller
+static void src_resume (Source *s, const char *line, const Lexer *lx, const Cmd *first) {
+    strcpy(s->line, line);
+    s->lx = *lx;
+    s->lx.content = s->line;
+    s->have = (first->sep != T_EOF && !lex_at_end(&s->lx));
+}
+
+static void src_error (const Source *s, const char *msg, const char *word) {
+    if (s->name) fprintf(stderr, "%s:%d: syntax error: %s%s%s\n", s->name, s->lineno, msg, word ? " " : "", word ? word : "");
+    else printf("Syntax error: %s%s%s\n", msg, word ? " " : "", word ? word : "");
+}
+
+// make sure lx holds a line that is not blank or a comment; -1 at EOF
+static int src_fill (Source *s) {
+    while (!s->have) {
+        if (s->one_line) return -1;
+        if (s->in == NULL) {
+            if (ed_readline(s->line, sizeof(s->line), "> ") < 0) return -1;
+        } else if (input_line(s->in, s->line, sizeof(s->line)) < 0) {
+            return -1;
+        }
+        s->lineno++;
+        s->line[strcspn(s->line, "\n")] = '\0';
+        size_t lead = strspn(s->line, " \t");
+        if (s->line[lead] == '\0' || s->line[lead] == '#') continue;
+        lex_init(&s->lx, s->line);
+        s->have = 1;
+    }
+    return 0;
+}
+
+// next statement into cmd: 1, 0 at EOF, -1 on a (reported) syntax error
+static int src_next (Source *s, Cmd *cmd) {
+    for (;;) {
+        if (src_fill(s) < 0) return 0;
+        uint64_t t_parse = now_ns();
+        cmd_init(cmd);
+        int p_res = parse_cmd(&s->lx, cmd);
+        hist_record(&h_parse, now_ns() - t_parse);
+        s->have = (p_res >= 0 && cmd->sep != T_EOF && !lex_at_end(&s->lx));
+        if (p_res == 1 && cmd->sep != T_DSEMI) { free_cmd(cmd); continue; }
+        if (p_res < 0 || cmd->hist_ref != NULL) {
+            src_error(s, p_res == -1 ? "too many arguments" : "bad command", NULL);
+            free_cmd(cmd);
+            return -1;
+        }
+        if (!s->one_line) read_heredocs(cmd, s->in);
+        return 1;
+    }
+}
+
+// the reserved word a statement starts with, if any
+static const char *stmt_keyword (const Cmd *cmd) {
+    const Cmd *first = cmd;
+    while (first->pipe_cmd) first = first->pipe_cmd;
+    if (first->argc == 0) return NULL;
+    for (int i = 0; reserved[i]; i++) {
+        if (strcmp(first->argv[0], reserved[i]) == 0) return reserved[i];
+    }
+    return NULL;
+}
+
+static int is_keyword (const char *kw, const char *const *set) {
+    for (; kw && *set; set++) if (strcmp(kw, *set) == 0) return 1;
+    return 0;
+}
+
+static int compile_stmt (Source *s, Program *p, Cmd *cmd);
+
+/* statements up to one that starts with a word in ends, which is left in
+ * end for the caller */
+static int compile_block (Source *s, Program *p, const char *const *ends, Cmd *end) {
+    for (;;) {
+        int r = src_next(s, end);
+        if (r == 0) src_error(s, "unexpected end of file, wanted", ends[0]);
+        if (r <= 0) return -1;
+        if (is_keyword(stmt_keyword(end), ends)) {
+            if (s->skip < 0) return 0;
+            src_error(s, "unexpected", stmt_keyword(end));
+            free_cmd(end);
+            return -1;
+        }
+        if (compile_stmt(s, p, end) < 0) return -1;
+    }
+}
+
+// "then cmd", "do cmd", "if cmd": compile what follows the reserved word
+static int compile_tail (Source *s, Program *p, Cmd *cmd) {
+    strip_prefix(cmd, stmt_keyword(cmd));
+    int empty = cmd->argc == 0 && cmd->pipe_cmd == NULL && !cmd->redir_in_path && !cmd->redir_out_path && !cmd->redir_in_data;
+    if (empty) { free_cmd(cmd); return 0; }
+    return compile_stmt(s, p, cmd);
+}
+
+// a construct's redirections are only known at its closing word: leave room
+#define REDIR_SLOTS 4
+
+static size_t compile_reserve (Program *p) {
+    size_t at = p->len;
+    for (int i = 0; i < REDIR_SLOTS; i++) prog_emit(p, OP_NOP, 0, 0, 0);
+    return at;
+}
+
+// check the closing "fi", "done" or "esac" and wrap the construct in its redirections
+static int compile_close (Source *s, Program *p, Cmd *end, size_t at) {
+    if (end->pipe_cmd || end->argc != 1 || end->is_background) {
+        src_error(s, "only < and > may follow", stmt_keyword(end));
+        free_cmd(end);
+        return -1;
+    }
+    s->close_sep = end->sep;
+    int in_reg = -1, out_reg = -1;
+    size_t in_push = 0, out_push = 0;
+    const char *in_word = end->redir_in_path ? end->redir_in_path : end->redir_in_data;
+    if (in_word) {
+        in_reg = p->nregs++;
+        p->code[at++] = (Insn){ OP_OPEN, in_reg, prog_word(p, in_word), end->redir_in_path ? R_IN : R_HERE };
+        in_push = at;
+        p->code[at++] = (Insn){ OP_PUSHFD, in_reg, STDIN_FILENO, 0 };
+    }
+    if (end->redir_out_path) {
+        out_reg = p->nregs++;
+        p->code[at++] = (Insn){ OP_OPEN, out_reg, prog_word(p, end->redir_out_path), R_OUT };
+        out_push = at;
+        p->code[at++] = (Insn){ OP_PUSHFD, out_reg, STDOUT_FILENO, 0 };
+    }
+    if (out_reg >= 0) prog_emit(p, OP_POPFD, out_reg, STDOUT_FILENO, 0);
+    if (out_reg >= 0) p->code[out_push].c = (int)p->len;
+    if (in_reg >= 0) prog_emit(p, OP_POPFD, in_reg, STDIN_FILENO, 0);
+    if (in_reg >= 0) p->code[in_push].c = (int)p->len;
+    free_cmd(end);
+    return 0;
+}
+
+/* if c1 / then A / elif c2 / then B / else C / fi:
+ *   c1; JFALSE L1; A; JMP end; L1: c2; JFALSE L2; B; JMP end; L2: C; end: */
+static int compile_if (Source *s, Program *p, Cmd *cmd) {
+    static const char *const then_[] = { "then", NULL };
+    static const char *const else_[] = { "fi", "elif", "else", NULL };
+    static const char *const fi_[] = { "fi", NULL };
+    size_t at = compile_reserve(p);
+    int exits = -1;
+    Cmd end;
+    if (compile_tail(s, p, cmd) < 0) return -1;
+    for (;;) {
+        if (compile_block(s, p, then_, &end) < 0) return -1;
+        int skip = emit_chained(p, OP_JFALSE, -1);
+        if (compile_tail(s, p, &end) < 0 || compile_block(s, p, else_, &end) < 0) return -1;
+        exits = emit_chained(p, OP_JMP, exits);
+        patch_chain(p, skip, p->len);
+        const char *kw = stmt_keyword(&end);
+        if (strcmp(kw, "elif") == 0) {
+            if (compile_tail(s, p, &end) < 0) return -1;
+            continue;
+        }
+        if (strcmp(kw, "else") == 0) {
+            if (compile_tail(s, p, &end) < 0 || compile_block(s, p, fi_, &end) < 0) return -1;
+        } else {
+            prog_emit(p, OP_STATUS, 0, 0, 0);	// no branch taken
+        }
+        break;
+    }
+    patch_chain(p, exits, p->len);
+    return compile_close(s, p, &end, at);
+}
+
+// while c / do A / done:  top: c; JFALSE out; A; JMP top; out: STATUS 0
+static int compile_while (Source *s, Program *p, Cmd *cmd, int until) {
+    static const char *const do_[] = { "do", NULL };
+    static const char *const done_[] = { "done", NULL };
+    size_t at = compile_reserve(p);
+    size_t top = p->len;
+    Cmd end;
+    if (compile_tail(s, p, cmd) < 0 || compile_block(s, p, do_, &end) < 0) return -1;
+    int out = emit_chained(p, until ? OP_JTRUE : OP_JFALSE, -1);
+    if (compile_tail(s, p, &end) < 0 || compile_block(s, p, done_, &end) < 0) return -1;
+    prog_emit(p, OP_JMP, (int)top, 0, 0);
+    patch_chain(p, out, p->len);
+    prog_emit(p, OP_STATUS, 0, 0, 0);
+    return compile_close(s, p, &end, at);
+}
+
+// for NAME in WORDS / do A / done:  FORINIT; top: FORNEXT out; A; JMP top; out:
+static int compile_for (Source *s, Program *p, Cmd *cmd) {
+    static const char *const done_[] = { "done", NULL };
+    int ok = cmd->pipe_cmd == NULL && cmd->argc >= 2 && !cmd->redir_in_path && !cmd->redir_out_path && !cmd->redir_in_data;
+    if (ok) {
+        const char *name = cmd->argv[1];
+        ok = is_name_start((unsigned char)name[0]);
+        for (size_t i = 1; ok && name[i]; i++) ok = is_name_char((unsigned char)name[i]);
+        ok = ok && (cmd->argc == 2 || strcmp(cmd->argv[2], "in") == 0);
+    }
+    if (!ok) { src_error(s, "usage: for NAME in WORDS ...", NULL); free_cmd(cmd); return -1; }
+
+    size_t at = compile_reserve(p);
+    int slot = p->nslots++;
+    int first = (int)p->nwords;
+    for (int i = 3; i < cmd->argc; i++) prog_word(p, cmd->argv[i]);
+    prog_emit(p, OP_STATUS, 0, 0, 0);
+    prog_emit(p, OP_FORINIT, slot, first, cmd->argc > 3 ? cmd->argc - 3 : 0);
+    size_t top = p->len;
+    prog_emit(p, OP_FORNEXT, slot, prog_word(p, cmd->argv[1]), 0);
+    free_cmd(cmd);
+
+    Cmd end;
+    int r = src_next(s, &end);
+    if (r == 0) src_error(s, "unexpected end of file, wanted", "do");
+    if (r <= 0) return -1;
+    if (strcmp(stmt_keyword(&end) ? stmt_keyword(&end) : "", "do") != 0) {
+        src_error(s, "wanted do before", stmt_keyword(&end) ? stmt_keyword(&end) : "command");
+        free_cmd(&end);
+        return -1;
+    }
+    if (compile_tail(s, p, &end) < 0 || compile_block(s, p, done_, &end) < 0) return -1;
+    prog_emit(p, OP_JMP, (int)top, 0, 0);
+    p->code[top].c = (int)p->len;
+    return compile_close(s, p, &end, at);
+}
+
+/* case WORD in / PAT|PAT) A ;; / ... / esac: every arm is a run of MATCH
+ * jumps into its body, then a jump to the next arm; bodies jump to the end */
+static int compile_case (Source *s, Program *p, Cmd *cmd) {
+    int ok = cmd->pipe_cmd == NULL && cmd->argc == 3 && strcmp(cmd->argv[2], "in") == 0 && !cmd->redir_in_path && !cmd->redir_out_path && !cmd->redir_in_data;
+    if (!ok) { src_error(s, "usage: case WORD in", NULL); free_cmd(cmd); return -1; }
+    size_t at = compile_reserve(p);
+    int slot = p->nslots++;
+    prog_emit(p, OP_CASEWORD, slot, prog_word(p, cmd->argv[1]), 0);
+    free_cmd(cmd);
+
+    int exits = -1;
+    Cmd end;
+    for (;;) {
+        if (src_fill(s) < 0) { src_error(s, "unexpected end of file, wanted", "esac"); return -1; }
+
+        // "esac" or a pattern list: "(a|b*)" or "a|b*)", then maybe a command
+        const char *t = s->line + s->lx.pos;
+        t += strspn(t, " \t");
+        if (strncmp(t, "esac", 4) == 0 && (t[4] == '\0' || !is_word((unsigned char)t[4]))) {
+            if (src_next(s, &end) <= 0) return -1;
+            break;
+        }
+        if (*t == '(') t++;
+        size_t plen = strcspn(t, ")");
+        if (t[plen] != ')') { src_error(s, "wanted PATTERN) in case", NULL); return -1; }
+        size_t arm = p->len;
+        for (size_t i = 0; i < plen; ) {
+            size_t n = strcspn(t + i, "|)");
+            char *pat = strndup(t + i, n);
+            if (!pat) { perror("strndup(pattern)"); exit(1); }
+            char *trim = pat + strspn(pat, " \t");
+            size_t tl = strlen(trim);
+            while (tl > 0 && is_ws((unsigned char)trim[tl - 1])) trim[--tl] = '\0';
+            prog_emit(p, OP_MATCH, slot, prog_word(p, trim), 0);
+            free(pat);
+            i += n + 1;
+        }
+        int next_arm = emit_chained(p, OP_JMP, -1);
+        for (size_t i = arm; i < (size_t)next_arm; i++) p->code[i].c = (int)p->len;
+        s->lx.pos = (size_t)(t + plen + 1 - s->line);
+
+        // the arm's commands, up to ";;" or "esac"
+        prog_emit(p, OP_STATUS, 0, 0, 0);
+        int closed = 0;
+        for (;;) {
+            int r = src_next(s, &end);
+            if (r == 0) src_error(s, "unexpected end of file, wanted", "esac");
+            if (r <= 0) return -1;
+            if (stmt_keyword(&end) && strcmp(stmt_keyword(&end), "esac") == 0) { closed = 1; break; }
+            int last = (end.sep == T_DSEMI);
+            if (last) end.sep = T_SEMI;
+            int empty = end.argc == 0 && end.pipe_cmd == NULL && !end.redir_in_path && !end.redir_out_path && !end.redir_in_data;
+            if (empty) free_cmd(&end);
+            else if (compile_stmt(s, p, &end) < 0) return -1;
+            if (last) break;
+        }
+        exits = emit_chained(p, OP_JMP, exits);
+        patch_chain(p, next_arm, p->len);
+        if (closed) break;
+    }
+    prog_emit(p, OP_STATUS, 0, 0, 0);	// no arm matched
+    patch_chain(p, exits, p->len);
+    return compile_close(s, p, &end, at);
+}
+
+static int compile_compound (Source *s, Program *p, Cmd *cmd, const char *kw) {
+    if (strcmp(kw, "if") == 0) return compile_if(s, p, cmd);
+    if (strcmp(kw, "while") == 0) return compile_while(s, p, cmd, 0);
+    if (strcmp(kw, "until") == 0) return compile_while(s, p, cmd, 1);
+    if (strcmp(kw, "for") == 0) return compile_for(s, p, cmd);
+    if (strcmp(kw, "case") == 0) return compile_case(s, p, cmd);
+    src_error(s, "unexpected", kw);
+    free_cmd(cmd);
+    return -1;
+}
+
+/* compile one statement; takes ownership of cmd. "a && b" is a then a jump
+ * over b taken when a fails ("||": when it succeeds); the jump lands on the
+ * check of the operator after b, which gives the left-to-right grouping */
+static int compile_stmt (Source *s, Program *p, Cmd *cmd) {
+    int skip = s->skip;
+    s->skip = -1;
+    if (cmd->sep == T_DSEMI) { src_error(s, "unexpected", ";;"); free_cmd(cmd); return -1; }
+
+    const char *kw = stmt_keyword(cmd);
+    TokKind sep = cmd->sep;
+    if (kw == NULL) {
+        compile_pipeline(p, cmd);
+        free_cmd(cmd);
+    } else {
+        if (compile_compound(s, p, cmd, kw) < 0) return -1;
+        sep = s->close_sep;
+    }
+    patch_chain(p, skip, p->len);
+    if (sep == T_AND || sep == T_OR) s->skip = emit_chained(p, sep == T_AND ? OP_JFALSE : OP_JTRUE, -1);
+    return 0;
+}
+
+// compile a line that cannot go on to further lines ("$(...)", "<(...)")
+static int compile_line (Program *p, const char *line) {
+    Source src; src_init(&src, NULL, NULL);
+    src.one_line = 1;
+    if (strlen(line) >= sizeof(src.line)) { puts("Syntax error: line too long"); return -1; }
+    strcpy(src.line, line);
+    lex_init(&src.lx, src.line);
+    src.have = !lex_at_end(&src.lx);
+
+    int rc = 0;
+    while (rc == 0 && src.have) {
+        Cmd cmd;
+        int r = src_next(&src, &cmd);
+        if (r <= 0) { rc = r; break; }
+        rc = compile_stmt(&src, p, &cmd);
+    }
+    if (rc == 0 && src.skip >= 0) { src_error(&src, "unexpected end of line after", "&& or ||"); rc = -1; }
+    return rc;
+}
+
+// --- SOURCE ---
+/* "source FILE" (or ". FILE") compiles the whole file into one program the
+ * first time it runs and keeps it, keyed by device and inode and checked
+ * against the file's size and mtime, so running the script again skips the
+ * lexer and parser entirely. Blank lines and "#" comments are skipped, here-
+ * document bodies and the rest of an "if", "for" and the like come from the
+ * lines that follow, and an "exit" line ends the script. A syntax error anywhere rejects the whole file. */
+typedef struct Script Script;
+struct Script {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    Program prog;
+    int running;	// a script that changes while it runs keeps its old program
+    Script *next;
+};
+
+static Script *scripts = NULL;
+
+static int compile_script (Program *p, const char *path, int fd) {
+    Input *in = (Input *)malloc(sizeof(Input));
+    if (!in) { perror("malloc(script)"); exit(1); }
+    in->fd = fd;
+    in->seekable = in->exact = 0;
+    in->pos = in->len = 0;
+
+    Source src; src_init(&src, in, path);
+    int rc = 0;
+    while (rc == 0 && src_fill(&src) == 0) {
+        if (src.lx.pos == 0 && strcmp(src.line + strspn(src.line, " \t"), "exit") == 0) break;
+        Cmd cmd;
+        int r = src_next(&src, &cmd);
+        if (r <= 0) { rc = r; break; }
+        rc = compile_stmt(&src, p, &cmd);
+    }
+    if (rc == 0 && src.skip >= 0) { src_error(&src, "unexpected end of file after", "&& or ||"); rc = -1; }
+    free(in);
+    return rc;
+}
+
+static int bi_source (Cmd *cmd) {
+    if (cmd->argc < 2) { printf("usage: %s file\n", cmd->argv[0]); return 2; }
+    const char *path = cmd->argv[1];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) { perror(path); if (fd >= 0) close(fd); return 1; }
+
+    Script *s = scripts;
+    while (s && (s->dev != st.st_dev || s->ino != st.st_ino)) s = s->next;
+    int fresh = s && s->size == st.st_size && s->mtime.tv_sec == st.st_mtim.tv_sec && s->mtime.tv_nsec == st.st_mtim.tv_nsec;
+    if (!fresh) {
+        Program prog; prog_init(&prog);
+        int rc = compile_script(&prog, path, fd);
+        if (rc < 0) { prog_free(&prog); close(fd); return 2; }
+        if (s == NULL || s->running) {
+            s = (Script *)calloc(1, sizeof(Script));
+            if (!s) { perror("calloc(script)"); exit(1); }
+            s->next = scripts;
+            scripts = s;
+        } else {
+            prog_free(&s->prog);
+        }
+        s->dev = st.st_dev;
+        s->ino = st.st_ino;
+        s->size = st.st_size;
+        s->mtime = st.st_mtim;
+        s->prog = prog;
+    }
+    close(fd);
+
+    s->running++;
+    vm_run(&s->prog);
+    s->running--;
+    return last_status;
+}
+
+// --- MAIN ---
+int main(int argc, char **argv) {
+    char buf[MAX_LINE];
+
+    vars_init();
+
+    void *shared = mmap(NULL, sizeof(MemoCounts), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED) memo_counts = shared;
+
+    const char *ps = var_get("OSH_PIPE_SIZE");
+    if (ps != NULL) pipe_size = atoi(ps);
+
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--explain") == 0) explain = 1;
+        else if (strcmp(argv[arg], "--no-rewrite") == 0) rewrite = 0;
+        else { fprintf(stderr, "usage: osh [--explain] [--no-rewrite] [script]\n"); return 2; }
+    }
+
+    // "osh FILE" runs the file as a compiled script
+    if (arg < argc) {
+        Cmd cmd; cmd_init(&cmd);
+        cmd_push_arg(&cmd, strdup("source"));
+        cmd_push_arg(&cmd, strdup(argv[arg]));
+        int rc = bi_source(&cmd);
+        free_cmd(&cmd);
+        fflush(stdout);
+        return rc;
+    }
+
+    const char *hs = var_get("HISTSIZE");
+    history_init(&history, (hs != NULL && atol(hs) > 0) ? (size_t)atol(hs) : HIST_DEFAULT_SIZE);
+    histfile_open(&history);
+
+    int interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if (!interactive) input_init(&script, STDIN_FILENO);
+
+    for (;;) {
+	// get input
+	if (interactive) {
+	    if (ed_readline(buf, MAX_LINE, "osh> ") < 0) break;
+	} else {
+	    printf("osh> ");
+	    fflush(stdout);
+	    if (input_line(&script, buf, MAX_LINE) < 0) break;
+	}
+
+        // strip newline
+        buf[strcspn(buf, "\n")] = '\0';
+
+	// empty line
+	if (buf[0] == '\0') continue;
+
+        // exit command
+        if (strcmp(buf, "exit") == 0) break;
+
+	// parse buffer
+	uint64_t t_parse = now_ns();
+	Cmd cmd; cmd_init(&cmd);
+	Lexer lx; lex_init(&lx, buf);
+	int p_res = parse_cmd(&lx, &cmd);
+	hist_record(&h_parse, now_ns() - t_parse);
+
+	if (p_res == 1) { free_cmd(&cmd); continue; } // empty
+	if (p_res == -1) { puts("Too many arguments."); free_cmd(&cmd); continue; }
+	if (p_res == -2) { puts("Syntax error."); free_cmd(&cmd); continue; }
+
+	// history
+	if (cmd.hist_ref) {
+	    if (history.first == history.next) { puts("No commands in history."); free_cmd(&cmd); continue; }
+	    const char *line = history_lookup(&history, cmd.hist_ref);
+	    if (line == NULL) { printf("!%s: event not found\n", cmd.hist_ref); free_cmd(&cmd); continue; }
+	    strcpy(buf, line);
+	    puts(buf);
+
+	    // relex and parse w/ the recalled line
+	    free_cmd(&cmd); cmd_init(&cmd);
+	    lex_init(&lx, buf);
+	    p_res = parse_cmd(&lx, &cmd);
+	    if (p_res != 0) { puts("Error parsing history."); free_cmd(&cmd); continue; }
+	}
+	history_add(&history, buf);
+	histfile_append(buf);
+
+	// here-document bodies come from the following input lines
+	read_heredocs(&cmd, interactive ? NULL : &script);
+	if (!interactive) input_sync(&script);
+
+	// "perfstat cmd ..." counts the whole pipeline with perf_event counters
+	int perf = strip_prefix(&cmd, "perfstat");
+	if (perf && cmd.argc == 0) { puts("usage: perfstat command [| command ...]"); free_cmd(&cmd); continue; }
+	if (perf && cmd.is_background) { puts("perfstat: ignored for background jobs."); perf = 0; }
+
+	/* lower the whole line to bytecode before running any of it: the
+	 * statements after ";", "&&" and "||", and the rest of an "if", "for"
+	 * and the like (which may read more lines) */
+	Program prog; prog_init(&prog);
+	Source src; src_init(&src, interactive ? NULL : &script, NULL);
+	src_resume(&src, buf, &lx, &cmd);
+	int c_res = compile_stmt(&src, &prog, &cmd);
+	while (c_res == 0 && (src.have || src.skip >= 0)) {
+	    int r = src_next(&src, &cmd);
+	    if (r == 0 && src.skip >= 0) src_error(&src, "unexpected end of file after", "&& or ||");
+	    if (r <= 0) { c_res = r == 0 && src.skip < 0 ? 0 : -1; break; }
+	    c_res = compile_stmt(&src, &prog, &cmd);
+	}
+	if (!interactive) input_sync(&script);
+	if (c_res < 0) { prog_free(&prog); continue; }
+
+	if (perf) perf = perf_open_all() > 0;
+	uint64_t t_start = now_ns();
+	if (perf) perf_ioctl_all(PERF_EVENT_IOC_ENABLE);
+	vm_run(&prog);
+	if (perf) { perf_ioctl_all(PERF_EVENT_IOC_DISABLE); perf_report(buf, now_ns() - t_start); }
+	prog_free(&prog);
     }
 
     // exit message